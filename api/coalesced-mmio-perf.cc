@@ -0,0 +1,175 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "runloop.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace {
+
+const int bench_port = 0xe0;
+unsigned iterations = 1000000;
+bool show_stats = false;
+volatile uint32_t* mmio_addr;
+
+void guest_mmio()
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        *mmio_addr = i;
+    }
+}
+
+void guest_pio()
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        asm volatile("outl %%eax, %%dx" : : "a"(i), "d"(bench_port));
+    }
+}
+
+// Count the writes the "device" sees, whether they arrive through the
+// coalesced ring or as an exit, and check they arrive in order.
+struct device {
+    device() : nr_writes(), nr_bad() {}
+    void write(uint32_t val) {
+        if (val != nr_writes) {
+            ++nr_bad;
+        }
+        ++nr_writes;
+    }
+    unsigned nr_writes;
+    unsigned nr_bad;
+};
+
+uint32_t ring_data(const kvm_coalesced_mmio& e)
+{
+    return *reinterpret_cast<const uint32_t*>(e.data);
+}
+
+// A full ring makes KVM fall back to a normal exit; older writes are
+// still queued, so drain them before handling the one that exited.
+bool handle_mmio(kvm::vcpu& vcpu, device& dev)
+{
+    vcpu.drain_coalesced_mmio([&] (const kvm_coalesced_mmio& e) {
+        dev.write(ring_data(e));
+    });
+    dev.write(*reinterpret_cast<uint32_t*>(vcpu.shared()->mmio.data));
+    return true;
+}
+
+bool handle_pio(kvm::vcpu& vcpu, device& dev)
+{
+    vcpu.drain_coalesced_mmio([&] (const kvm_coalesced_mmio& e) {
+        dev.write(ring_data(e));
+    });
+    kvm_run* run = vcpu.shared();
+    dev.write(*reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(run)
+                                           + run->io.data_offset));
+    return true;
+}
+
+bool run_test(kvm::vm& vm, kvm::vcpu& vcpu, bool pio, bool coalesced)
+{
+    uint64_t addr = pio ? bench_port : identity::gpa(const_cast<uint32_t*>(mmio_addr));
+    uint32_t size = pio ? 4 : 4096;
+    device dev;
+
+    if (coalesced) {
+        vm.register_coalesced_mmio(addr, size, pio);
+    }
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        stats.add(vcpu);
+    }
+    identity::vcpu guest(vcpu, pio ? guest_pio : guest_mmio);
+    run_loop loop(vcpu);
+    loop.on_pio(bench_port, std::bind(handle_pio, std::placeholders::_1,
+                                      std::ref(dev)));
+    loop.on_mmio(addr, size, std::bind(handle_mmio, std::placeholders::_1,
+                                       std::ref(dev)));
+    uint64_t start_ns = time_ns();
+    loop.run();
+    vcpu.drain_coalesced_mmio([&] (const kvm_coalesced_mmio& e) {
+        dev.write(ring_data(e));
+    });
+    uint64_t ns = time_ns() - start_ns;
+    if (coalesced) {
+        vm.unregister_coalesced_mmio(addr, size, pio);
+    }
+
+    uint64_t nr_exits = loop.stats(pio ? KVM_EXIT_IO : KVM_EXIT_MMIO).count();
+    printf("%-4s %-10s %10u writes, %10llu exits, %12.0f writes/sec%s\n",
+           pio ? "pio" : "mmio", coalesced ? "coalesced" : "exit",
+           dev.nr_writes, (unsigned long long)nr_exits,
+           dev.nr_writes * 1e9 / ns,
+           dev.nr_writes != iterations || dev.nr_bad ? ", FAIL" : "");
+    if (show_stats) {
+        stats.print(stdout);
+    }
+    return dev.nr_writes == iterations && !dev.nr_bad;
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+
+    while ((opt = getopt(ac, av, "S")) != -1) {
+        switch (opt) {
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("coalesced-mmio-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (optind < ac) {
+        iterations = atoi(av[optind]);
+    }
+}
+
+int test_main(int ac, char** av)
+{
+    parse_options(ac, av);
+
+    kvm::system sys;
+    if (show_stats && !stats_supported(sys, "coalesced-mmio-perf")) {
+        return 1;
+    }
+    if (!sys.check_extension(KVM_CAP_COALESCED_MMIO)) {
+        printf("coalesced-mmio-perf: KVM_CAP_COALESCED_MMIO not supported\n");
+        return 1;
+    }
+    bool have_pio = sys.check_extension(KVM_CAP_COALESCED_PIO);
+
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    void* hole_page;
+    int ret = posix_memalign(&hole_page, 4096, 4096);
+    if (ret) {
+        throw errno_exception(ret);
+    }
+    mmio_addr = static_cast<volatile uint32_t*>(hole_page);
+    identity::hole hole(hole_page, 4096);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+
+    bool ok = run_test(vm, vcpu, false, false);
+    ok = run_test(vm, vcpu, false, true) && ok;
+    if (have_pio) {
+        ok = run_test(vm, vcpu, true, false) && ok;
+        ok = run_test(vm, vcpu, true, true) && ok;
+    } else {
+        printf("pio  skipped, KVM_CAP_COALESCED_PIO not supported\n");
+    }
+    return ok ? 0 : 1;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
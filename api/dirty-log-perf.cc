@@ -2,24 +2,32 @@
 #include "exception.hh"
 #include "memmap.hh"
 #include "identity.hh"
+#include "guestmem.hh"
+#include "stats.hh"
+#include "runloop.hh"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <memory>
 
 namespace {
 
 const int page_size	= 4096;
 int64_t nr_total_pages	= 256 * 1024;
 int64_t nr_slot_pages	= 256 * 1024;
-
-// Return the current time in nanoseconds.
-uint64_t time_ns()
-{
-    struct timespec ts;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
-}
+bool compare_ring	= false;
+bool sweep_clear	= false;
+int max_vcpus		= 0;
+bool overlap_writers	= false;
+int64_t scan_gib	= 0;
+bool show_stats		= false;
+std::vector<guest_memory::backing> backings;
+const uint64_t scaling_run_ns = 1000000000;
 
 // Update nr_to_write pages selected from nr_pages pages.
 void write_mem(void* slot_head, int64_t nr_to_write, int64_t nr_pages)
@@ -34,32 +42,400 @@ void write_mem(void* slot_head, int64_t nr_to_write, int64_t nr_pages)
 }
 
 // Let the guest update nr_to_write pages selected from nr_pages pages.
-void do_guest_write(kvm::vcpu& vcpu, void* slot_head,
+void do_guest_write(kvm::vcpu& vcpu, mem_map& memmap, void* slot_head,
                     int64_t nr_to_write, int64_t nr_pages)
 {
     identity::vcpu guest_write_thread(vcpu, std::bind(write_mem, slot_head,
                                                       nr_to_write, nr_pages));
     vcpu.run();
+    // With a dirty ring the guest exits when its ring fills up; collect
+    // the entries (they stay pending in the slot) and let it continue.
+    while (vcpu.shared()->exit_reason == KVM_EXIT_DIRTY_RING_FULL) {
+        memmap.harvest_dirty_rings();
+        vcpu.run();
+    }
 }
 
+struct harvest_sample {
+    int64_t expected;
+    int dirty;
+    uint64_t ns;	// including rings harvested early because they were full
+};
+
 // Check how long it takes to update dirty log.
-void check_dirty_log(kvm::vcpu& vcpu, mem_slot& slot, void* slot_head)
+std::vector<harvest_sample> check_dirty_log(kvm::vcpu& vcpu, mem_map& memmap,
+                                            mem_slot& slot, void* slot_head)
 {
+    std::vector<harvest_sample> samples;
+
     slot.set_dirty_logging(true);
     slot.update_dirty_log();
 
     for (int64_t i = 1; i <= nr_slot_pages; i *= 2) {
-        do_guest_write(vcpu, slot_head, i, nr_slot_pages);
+        do_guest_write(vcpu, memmap, slot_head, i, nr_slot_pages);
 
         uint64_t start_ns = time_ns();
         int n = slot.update_dirty_log();
         uint64_t end_ns = time_ns();
 
-        printf("get dirty log: %10lld ns for %10d dirty pages (expected %lld)\n",
-               end_ns - start_ns, n, i);
+        harvest_sample sample = { i, n, end_ns - start_ns };
+        samples.push_back(sample);
+    }
+
+    slot.set_dirty_logging(false);
+    return samples;
+}
+
+struct clear_sample {
+    int64_t chunk_pages;
+    int64_t nr_ioctls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+// With manual dirty log protection, dirty the whole slot, harvest it and
+// measure how long it takes to write-protect it again in chunks of
+// different sizes.  The longest single KVM_CLEAR_DIRTY_LOG call is the
+// worst stall a vcpu faulting on mmu_lock can see.
+std::vector<clear_sample> check_clear_dirty_log(kvm::vcpu& vcpu, mem_map& memmap,
+                                                mem_slot& slot, void* slot_head)
+{
+    std::vector<clear_sample> samples;
+
+    slot.set_dirty_logging(true);
+    slot.update_dirty_log();
+    slot.clear_dirty_log(0, nr_slot_pages);
+
+    // KVM_CLEAR_DIRTY_LOG works in multiples of 64 pages
+    for (int64_t chunk = 64; ; chunk *= 2) {
+        if (chunk > nr_slot_pages) {
+            chunk = nr_slot_pages;
+        }
+        do_guest_write(vcpu, memmap, slot_head, nr_slot_pages, nr_slot_pages);
+        slot.update_dirty_log();
+
+        clear_sample sample = { chunk, 0, 0, 0 };
+        for (int64_t first = 0; first < nr_slot_pages; first += chunk) {
+            int64_t npages = std::min(chunk, nr_slot_pages - first);
+            uint64_t start_ns = time_ns();
+            slot.clear_dirty_log(first, npages);
+            uint64_t ns = time_ns() - start_ns;
+            sample.total_ns += ns;
+            sample.max_ns = std::max(sample.max_ns, ns);
+            ++sample.nr_ioctls;
+        }
+        samples.push_back(sample);
+
+        if (chunk == nr_slot_pages || chunk * page_size >= (1LL << 30)) {
+            break;
+        }
+    }
+
+    slot.set_dirty_logging(false);
+    return samples;
+}
+
+// Write one byte in each of nr_pages pages starting at head, over and
+// over until running is cleared, counting the pages written.
+void write_mem_loop(volatile bool& running, volatile char* head,
+                    int64_t nr_pages, volatile uint64_t* nr_written)
+{
+    while (running) {
+        for (int64_t i = 0; i < nr_pages && running; ++i) {
+            ++head[i * page_size];
+            ++*nr_written;
+        }
+    }
+}
+
+// Host thread body for one guest writer.  A full dirty ring only means
+// the harvester has not caught up yet, so just re-enter the guest.
+void run_writer(kvm::vcpu& vcpu, std::function<void ()> guest_func,
+                std::atomic<int>& nr_exited)
+{
+    identity::vcpu guest_write_thread(vcpu, guest_func);
+    do {
+        vcpu.run();
+    } while (vcpu.shared()->exit_reason == KVM_EXIT_DIRTY_RING_FULL);
+    ++nr_exited;
+}
+
+struct scaling_sample {
+    int nr_vcpus;
+    int64_t nr_harvests;
+    int64_t nr_dirty;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t nr_written;
+    uint64_t write_ns;
+};
+
+// Let every vcpu write its share of the slot (or all of it, if the
+// writers overlap) from its own host thread, and harvest the dirty log
+// back to back while they run.
+scaling_sample check_dirty_log_scaling(std::vector<kvm::vcpu*>& vcpus,
+                                       mem_slot& slot, void* slot_head)
+{
+    int nr_vcpus = vcpus.size();
+    int64_t nr_pages = overlap_writers ? nr_slot_pages
+                                       : nr_slot_pages / nr_vcpus;
+    volatile bool running = true;
+    // one cache line per counter, so writers do not share lines
+    const int stride = 64 / sizeof(uint64_t);
+    std::vector<uint64_t> written(nr_vcpus * stride);
+    std::vector<std::thread> writers;
+    std::atomic<int> nr_exited(0);
+
+    slot.set_dirty_logging(true);
+    slot.update_dirty_log();
+
+    for (int i = 0; i < nr_vcpus; ++i) {
+        char* head = static_cast<char*>(slot_head);
+        if (!overlap_writers) {
+            head += i * nr_pages * page_size;
+        }
+        std::function<void ()> guest_func
+            = std::bind(write_mem_loop, std::ref(running), head, nr_pages,
+                        &written[i * stride]);
+        writers.push_back(std::thread(run_writer, std::ref(*vcpus[i]),
+                                      guest_func, std::ref(nr_exited)));
+    }
+
+    // wait until every writer is in the guest
+    for (int i = 0; i < nr_vcpus; ++i) {
+        while (!*static_cast<volatile uint64_t*>(&written[i * stride])) {
+            asm volatile("pause");
+        }
     }
 
+    scaling_sample sample = { nr_vcpus, 0, 0, 0, 0, 0, 0 };
+    uint64_t written_before = 0;
+    for (int i = 0; i < nr_vcpus; ++i) {
+        written_before += *static_cast<volatile uint64_t*>(&written[i * stride]);
+    }
+    uint64_t run_start_ns = time_ns();
+    while (time_ns() - run_start_ns < scaling_run_ns) {
+        uint64_t start_ns = time_ns();
+        sample.nr_dirty += slot.update_dirty_log();
+        uint64_t ns = time_ns() - start_ns;
+        sample.total_ns += ns;
+        sample.max_ns = std::max(sample.max_ns, ns);
+        ++sample.nr_harvests;
+    }
+    for (int i = 0; i < nr_vcpus; ++i) {
+        sample.nr_written += *static_cast<volatile uint64_t*>(&written[i * stride]);
+    }
+    sample.write_ns = time_ns() - run_start_ns;
+    sample.nr_written -= written_before;
+
+    running = false;
+    // a writer whose ring is full exits again on every KVM_RUN, and only
+    // sees running cleared once its ring has been reset
+    while (nr_exited < nr_vcpus) {
+        slot.update_dirty_log();
+    }
+    for (auto& t : writers) {
+        t.join();
+    }
     slot.set_dirty_logging(false);
+    return sample;
+}
+
+// Compare the bitmap scanning implementations on a synthetic log for a
+// slot of scan_gib GiB, from fully dirty down to very sparse.
+void check_bitmap_scan()
+{
+    typedef dirty_bitmap::ulong ulong;
+    const dirty_bitmap::scan_impl impls[] = {
+        dirty_bitmap::scan_scalar, dirty_bitmap::scan_popcnt,
+        dirty_bitmap::scan_avx2,
+    };
+    uint64_t nr_pages = uint64_t(scan_gib) << (30 - 12);
+    size_t nwords = nr_pages / dirty_bitmap::bits_per_word;
+    std::vector<ulong> log(nwords);
+
+    for (int shift = 0; shift <= 20; shift += 4) {
+        uint64_t interval = uint64_t(1) << shift;
+        std::fill(log.begin(), log.end(), 0);
+        for (uint64_t page = 0; page < nr_pages; page += interval) {
+            // the last interval may be cut short by the end of the slot
+            uint64_t pagenr = page + random() % std::min(interval,
+                                                         nr_pages - page);
+            log[pagenr / dirty_bitmap::bits_per_word]
+                |= 1UL << (pagenr % dirty_bitmap::bits_per_word);
+        }
+        for (auto impl : impls) {
+            if (!dirty_bitmap::scan_supported(impl)) {
+                continue;
+            }
+            uint64_t start_ns = time_ns();
+            uint64_t n = dirty_bitmap::count(log.data(), nwords, impl);
+            uint64_t count_ns = time_ns() - start_ns;
+
+            uint64_t visited = 0;
+            start_ns = time_ns();
+            dirty_bitmap::for_each(log.data(), nwords,
+                                   [&] (uint64_t pagenr) { ++visited; }, impl);
+            uint64_t iterate_ns = time_ns() - start_ns;
+
+            printf("scan %-6s: 1/%-8lld %12lld dirty, count %12lld ns, "
+                   "iterate %12lld ns%s\n",
+                   dirty_bitmap::scan_name(impl), (long long)interval, (long long)n,
+                   (long long)count_ns, (long long)iterate_ns, visited == n ? "" : " MISMATCH");
+        }
+    }
+}
+
+// Set up a fresh VM whose memory mem is split into the measured slot and
+// the rest, pre-fault it and pass it to fn.  If ring_size is
+// non-zero the VM harvests with per-vcpu dirty rings instead of
+// KVM_GET_DIRTY_LOG.
+template <typename Fn>
+void with_test_vm(kvm::system& sys, const guest_memory& mem,
+                  uint32_t ring_size, bool manual_protect, int nr_vcpus, Fn fn)
+{
+    kvm::vm vm(sys);
+    if (ring_size) {
+        vm.enable_dirty_log_ring(ring_size);
+    }
+    if (manual_protect) {
+        vm.enable_manual_dirty_log_protect();
+    }
+    mem_map memmap(vm);
+
+    void* mem_head = mem.address();
+    identity::hole hole(mem);
+    identity::vm ident_vm(vm, memmap, hole);
+    uint64_t mem_addr = identity::gpa(mem_head);
+    std::vector<std::unique_ptr<kvm::vcpu> > vcpu_list;
+    std::vector<kvm::vcpu*> vcpus;
+    for (int i = 0; i < nr_vcpus; ++i) {
+        vcpu_list.push_back(std::unique_ptr<kvm::vcpu>(new kvm::vcpu(vm, i)));
+        vcpus.push_back(vcpu_list.back().get());
+        if (ring_size) {
+            memmap.add_dirty_ring(*vcpus.back());
+        }
+    }
+
+    uint64_t slot_size = nr_slot_pages * page_size;
+    uint64_t next_size = mem.size() - slot_size;
+    mem_slot slot(memmap, mem_addr, slot_size, mem);
+    mem_slot other_slot(memmap, mem_addr + slot_size, next_size, mem,
+                        slot_size);
+
+    // pre-allocate shadow pages
+    do_guest_write(*vcpus[0], memmap, mem_head, nr_total_pages, nr_total_pages);
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        for (auto v : vcpus) {
+            stats.add(*v);
+        }
+    }
+    fn(vcpus, memmap, slot);
+    if (show_stats) {
+        printf("kvm stats:\n");
+        stats.print(stdout);
+    }
+}
+
+std::vector<harvest_sample> run_sweep(kvm::system& sys,
+                                      const guest_memory& mem,
+                                      uint32_t ring_size)
+{
+    std::vector<harvest_sample> samples;
+    with_test_vm(sys, mem, ring_size, false, 1,
+                 [&] (std::vector<kvm::vcpu*>& vcpus, mem_map& memmap,
+                      mem_slot& slot) {
+                     samples = check_dirty_log(*vcpus[0], memmap, slot,
+                                               mem.address());
+                 });
+    return samples;
+}
+
+std::vector<clear_sample> run_clear_sweep(kvm::system& sys,
+                                          const guest_memory& mem)
+{
+    std::vector<clear_sample> samples;
+    with_test_vm(sys, mem, 0, true, 1,
+                 [&] (std::vector<kvm::vcpu*>& vcpus, mem_map& memmap,
+                      mem_slot& slot) {
+                     samples = check_clear_dirty_log(*vcpus[0], memmap, slot,
+                                                     mem.address());
+                 });
+    return samples;
+}
+
+scaling_sample run_scaling(kvm::system& sys, const guest_memory& mem,
+                           uint32_t ring_size, int nr_vcpus)
+{
+    scaling_sample sample;
+    with_test_vm(sys, mem, ring_size, false, nr_vcpus,
+                 [&] (std::vector<kvm::vcpu*>& vcpus, mem_map& memmap,
+                      mem_slot& slot) {
+                     sample = check_dirty_log_scaling(vcpus, slot,
+                                                      mem.address());
+                 });
+    return sample;
+}
+
+void print_scaling(const char* mode, const scaling_sample& s)
+{
+    // no harvests if the run ended before the first one
+    int64_t n = std::max(s.nr_harvests, int64_t(1));
+    printf("%-6s %6d %10lld %12lld %12lld %12.1f %14.0f\n", mode,
+           s.nr_vcpus, (long long)s.nr_harvests,
+           (long long)(s.total_ns / n), (long long)s.max_ns,
+           double(s.nr_dirty) / n, s.nr_written * 1e9 / s.write_ns);
+}
+
+// Run the selected measurement on guest memory from mem.
+void run_backing(kvm::system& sys, const guest_memory& mem, uint32_t ring_size)
+{
+    if (sweep_clear) {
+        std::vector<clear_sample> clear = run_clear_sweep(sys, mem);
+        for (auto& s : clear) {
+            printf("clear dirty log: chunk %8lld KiB, %8lld ioctls, "
+                   "total %10lld ns, max %10lld ns\n",
+                   (long long)(s.chunk_pages * page_size / 1024),
+                   (long long)s.nr_ioctls, (long long)s.total_ns,
+                   (long long)s.max_ns);
+        }
+        return;
+    }
+
+    if (max_vcpus) {
+        printf("%-6s %6s %10s %12s %12s %12s %14s\n", "mode", "vcpus",
+               "harvests", "avg ns", "max ns", "dirty/harv", "writes/sec");
+        for (int n = 1; ; n = std::min(n * 2, max_vcpus)) {
+            print_scaling("bitmap", run_scaling(sys, mem, 0, n));
+            if (ring_size) {
+                print_scaling("ring", run_scaling(sys, mem, ring_size, n));
+            }
+            if (n == max_vcpus) {
+                break;
+            }
+        }
+        return;
+    }
+
+    std::vector<harvest_sample> bitmap = run_sweep(sys, mem, 0);
+    if (!compare_ring) {
+        for (auto& s : bitmap) {
+            printf("get dirty log: %10lld ns for %10d dirty pages (expected %lld)\n",
+                   (long long)s.ns, s.dirty, (long long)s.expected);
+        }
+        return;
+    }
+
+    std::vector<harvest_sample> ring = run_sweep(sys, mem, ring_size);
+    printf("%10s %14s %10s %14s %10s\n", "expected",
+           "bitmap ns", "found", "ring ns", "found");
+    for (size_t i = 0; i < bitmap.size(); ++i) {
+        printf("%10lld %14lld %10d %14lld %10d\n", (long long)bitmap[i].expected,
+               (long long)bitmap[i].ns, bitmap[i].dirty,
+               (long long)ring[i].ns, ring[i].dirty);
+    }
 }
 
 }
@@ -69,8 +445,48 @@ void parse_options(int ac, char **av)
     int opt;
     char *endptr;
 
-    while ((opt = getopt(ac, av, "n:m:")) != -1) {
+    while ((opt = getopt(ac, av, "n:m:rcv:os:b:S")) != -1) {
         switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "all") == 0) {
+                for (int b = 0; b < guest_memory::nr_backings; ++b) {
+                    backings.push_back(guest_memory::backing(b));
+                }
+            } else {
+                guest_memory::backing b;
+                if (!guest_memory::parse(optarg, b)) {
+                    printf("dirty-log-perf: Invalid backing: -b %s\n", optarg);
+                    exit(1);
+                }
+                backings.push_back(b);
+            }
+            break;
+        case 's':
+            scan_gib = atoi(optarg);
+            if (scan_gib <= 0) {
+                printf("dirty-log-perf: Invalid number: -s %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'v':
+            max_vcpus = atoi(optarg);
+            if (max_vcpus <= 0) {
+                printf("dirty-log-perf: Invalid number: -v %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            overlap_writers = true;
+            break;
+        case 'r':
+            compare_ring = true;
+            break;
+        case 'c':
+            sweep_clear = true;
+            break;
+        case 'S':
+            show_stats = true;
+            break;
         case 'n':
             errno = 0;
             nr_slot_pages = strtol(optarg, &endptr, 10);
@@ -101,42 +517,68 @@ void parse_options(int ac, char **av)
 
     if (nr_slot_pages > nr_total_pages) {
         printf("dirty-log-perf: Invalid setting: slot %lld > mem %lld\n",
-               nr_slot_pages, nr_total_pages);
+               (long long)nr_slot_pages, (long long)nr_total_pages);
+        exit(1);
+    }
+    // without -o every writer needs a page of its own
+    if (!overlap_writers && max_vcpus > nr_slot_pages) {
+        printf("dirty-log-perf: Invalid setting: %d vcpus > slot %lld\n",
+               max_vcpus, (long long)nr_slot_pages);
         exit(1);
     }
+    if (backings.empty()) {
+        backings.push_back(guest_memory::anon);
+    }
     printf("dirty-log-perf: %lld slot pages / %lld mem pages\n",
-           nr_slot_pages, nr_total_pages);
+           (long long)nr_slot_pages, (long long)nr_total_pages);
 }
 
 int test_main(int ac, char **av)
 {
     kvm::system sys;
-    kvm::vm vm(sys);
-    mem_map memmap(vm);
 
     parse_options(ac, av);
 
-    void* mem_head;
-    int64_t mem_size = nr_total_pages * page_size;
-    if (posix_memalign(&mem_head, page_size, mem_size)) {
-        printf("dirty-log-perf: Could not allocate guest memory.\n");
-        exit(1);
+    if (scan_gib) {
+        printf("dirty-log-perf: bitmap scan for a %lld GiB slot\n",
+               (long long)scan_gib);
+        check_bitmap_scan();
+        return 0;
     }
-    uint64_t mem_addr = reinterpret_cast<uintptr_t>(mem_head);
 
-    identity::hole hole(mem_head, mem_size);
-    identity::vm ident_vm(vm, memmap, hole);
-    kvm::vcpu vcpu(vm, 0);
+    uint32_t ring_size = 0;
+    if (compare_ring) {
+        ring_size = sys.get_extension_int(KVM_CAP_DIRTY_LOG_RING);
+        if (!ring_size) {
+            printf("dirty-log-perf: KVM_CAP_DIRTY_LOG_RING not supported\n");
+            exit(1);
+        }
+        printf("dirty-log-perf: %u dirty ring entries per vcpu\n",
+               ring_size / (unsigned)sizeof(kvm_dirty_gfn));
+    }
 
-    uint64_t slot_size = nr_slot_pages * page_size;
-    uint64_t next_size = mem_size - slot_size;
-    uint64_t next_addr = mem_addr + slot_size;
-    mem_slot slot(memmap, mem_addr, slot_size, mem_head);
-    mem_slot other_slot(memmap, next_addr, next_size, (void *)next_addr);
+    if (show_stats && !stats_supported(sys, "dirty-log-perf")) {
+        exit(1);
+    }
 
-    // pre-allocate shadow pages
-    do_guest_write(vcpu, mem_head, nr_total_pages, nr_total_pages);
-    check_dirty_log(vcpu, slot, mem_head);
+    if (sweep_clear && !sys.check_extension(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2)) {
+        printf("dirty-log-perf: KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 not supported\n");
+        exit(1);
+    }
+
+    for (auto b : backings) {
+        std::unique_ptr<guest_memory> mem;
+        try {
+            mem.reset(new guest_memory(nr_total_pages * page_size, b));
+        } catch (errno_exception& e) {
+            printf("\nbacking %s: not available, skipped\n",
+                   guest_memory::name(b));
+            continue;
+        }
+        printf("\nbacking %s: %zu KiB pages\n", guest_memory::name(b),
+               mem->page_size() / 1024);
+        run_backing(sys, *mem, ring_size);
+    }
     return 0;
 }
 
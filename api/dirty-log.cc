@@ -28,7 +28,7 @@ void check_dirty_log(mem_slot& slot,
                      volatile int* shared_var,
                      int& nr_fail)
 {
-    uint64_t shared_var_gpa = reinterpret_cast<uint64_t>(shared_var);
+    uint64_t shared_var_gpa = identity::gpa(const_cast<int*>(shared_var));
     slot.set_dirty_logging(true);
     slot.update_dirty_log();
     for (int i = 0; i < 10000000; ++i) {
@@ -62,8 +62,7 @@ int test_main(int ac, char **av)
     kvm::vcpu vcpu(vm, 0);
     bool running = true;
     int nr_fail = 0;
-    mem_slot logged_slot(memmap,
-                         reinterpret_cast<uintptr_t>(logged_slot_virt),
+    mem_slot logged_slot(memmap, identity::gpa(logged_slot_virt),
                          4096, logged_slot_virt);
     std::thread host_poll_thread(check_dirty_log, std::ref(logged_slot),
                                    std::ref(running),
@@ -0,0 +1,300 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "runloop.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include <sys/eventfd.h>
+#include <x86intrin.h>
+#include <thread>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace {
+
+const int kick_port = 0xe0;
+const uint32_t irq_gsi = 24;
+const uint32_t irq_vector = 0x40;
+unsigned iterations = 100000;
+bool show_stats = false;
+
+// The guest kicks by writing the page below the APIC page; it is left out
+// of guest memory (see the hole in test_main()), so each write is an MMIO
+// exit.  The flags below live in host memory that the guest sees as well.
+volatile uint32_t* kick_addr = reinterpret_cast<uint32_t*>(identity::apic_page
+                                                           - 4096);
+volatile uint32_t ack;
+volatile uint32_t nr_irqs;
+volatile uint32_t guest_ready;
+std::vector<uint64_t> samples;
+
+void kick(bool mmio)
+{
+    if (mmio) {
+        *kick_addr = 1;
+    } else {
+        asm volatile("outb %%al, %%dx" : : "a"(1), "d"(kick_port));
+    }
+}
+
+void wait_for(volatile uint32_t& var, uint32_t val)
+{
+    while (var != val) {
+        asm volatile("pause");
+    }
+}
+
+// Guest: kick the host and wait for its acknowledgement, timing each
+// round trip in (guest) TSC cycles.
+void guest_kick_pingpong(bool mmio)
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        uint64_t start = __rdtsc();
+        kick(mmio);
+        wait_for(ack, i + 1);
+        samples[i] = __rdtsc() - start;
+    }
+}
+
+void guest_kick_stream(bool mmio)
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        kick(mmio);
+    }
+}
+
+// Guest: acknowledge every interrupt as soon as the handler has seen it.
+void guest_irq_pingpong()
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        wait_for(nr_irqs, i + 1);
+        ack = i + 1;
+    }
+}
+
+void count_irq()
+{
+    nr_irqs = nr_irqs + 1;
+}
+
+bool ack_exit(kvm::vcpu& vcpu)
+{
+    ack = ack + 1;
+    return true;
+}
+
+// Backend thread: consume guest kicks from the eventfd.
+void eventfd_backend(int efd)
+{
+    while (ack < iterations) {
+        uint64_t n;
+        if (read(efd, &n, sizeof(n)) == sizeof(n)) {
+            ack = ack + n;
+        }
+    }
+}
+
+// Backend thread: interrupt the guest via irqfd or KVM_SIGNAL_MSI and
+// time until the guest acknowledges, in host TSC cycles.
+void irq_backend(kvm::vm& vm, int efd)
+{
+    wait_for(guest_ready, 1);
+    for (unsigned i = 0; i < iterations; ++i) {
+        uint64_t start = __rdtsc();
+        if (efd >= 0) {
+            uint64_t one = 1;
+            if (write(efd, &one, sizeof(one)) != sizeof(one)) {
+                throw errno_exception(errno);
+            }
+        } else {
+            vm.signal_msi(identity::apic_page, irq_vector);
+        }
+        wait_for(ack, i + 1);
+        samples[i] = __rdtsc() - start;
+    }
+}
+
+void vcpu_thread(kvm::vcpu& vcpu, std::function<void ()> guest_func,
+                 bool irqs)
+{
+    identity::vcpu guest(vcpu, guest_func);
+    if (irqs) {
+        guest.enable_interrupts(count_irq);
+    }
+    guest_ready = 1;
+    run_loop loop(vcpu);
+    loop.on_pio(kick_port, ack_exit);
+    loop.on_mmio(identity::gpa(const_cast<uint32_t*>(kick_addr)), 4, ack_exit);
+    loop.run();
+}
+
+double scale;
+
+void report(const char* name, bool pingpong, uint64_t ns)
+{
+    printf("%-22s %12.0f/sec", name, iterations * 1e9 / ns);
+    if (pingpong) {
+        std::vector<uint64_t> ns_samples;
+        latency_histogram h;
+        for (auto s : samples) {
+            ns_samples.push_back(s / scale);
+            h.add(s / scale);
+        }
+        printf("  rtt ns min %llu mean %.0f p50 %llu p99 %llu max %llu",
+               (unsigned long long)h.min(), h.mean(),
+               (unsigned long long)percentile(ns_samples, 50),
+               (unsigned long long)percentile(ns_samples, 99),
+               (unsigned long long)h.max());
+    }
+    printf("\n");
+}
+
+// Guest-to-host notification, either as a plain exit handled on the
+// vcpu thread or through an ioeventfd read by a backend thread.
+void run_kick(kvm::vm& vm, kvm::vcpu& vcpu, bool mmio, bool use_eventfd,
+              bool pingpong)
+{
+    int efd = -1;
+    ack = 0;
+    if (use_eventfd) {
+        efd = eventfd(0, 0);
+        if (efd < 0) {
+            throw errno_exception(errno);
+        }
+        // the MMIO kick also exercises datamatch
+        vm.add_ioeventfd(efd, mmio ? identity::gpa(const_cast<uint32_t*>(kick_addr))
+                                   : kick_port,
+                         mmio ? 4 : 1, !mmio, mmio, 1);
+    }
+
+    uint64_t start_ns = time_ns();
+    std::thread backend;
+    if (use_eventfd) {
+        backend = std::thread(eventfd_backend, efd);
+    }
+    auto guest = pingpong ? guest_kick_pingpong : guest_kick_stream;
+    std::thread vcpu_thr(vcpu_thread, std::ref(vcpu),
+                         std::bind(guest, mmio), false);
+    vcpu_thr.join();
+    if (use_eventfd) {
+        backend.join();
+    }
+    uint64_t ns = time_ns() - start_ns;
+
+    if (use_eventfd) {
+        vm.remove_ioeventfd(efd, mmio ? identity::gpa(const_cast<uint32_t*>(kick_addr))
+                                      : kick_port,
+                            mmio ? 4 : 1, !mmio, mmio, 1);
+        close(efd);
+    }
+
+    char name[64];
+    snprintf(name, sizeof name, "%s %s %s", mmio ? "mmio" : "pio",
+             use_eventfd ? "ioeventfd" : "exit",
+             pingpong ? "rtt" : "stream");
+    report(name, pingpong, ns);
+}
+
+// Host-to-guest interrupt through an irqfd or KVM_SIGNAL_MSI.
+void run_irq(kvm::vm& vm, kvm::vcpu& vcpu, bool use_irqfd)
+{
+    int efd = -1;
+    ack = 0;
+    nr_irqs = 0;
+    guest_ready = 0;
+    if (use_irqfd) {
+        efd = eventfd(0, 0);
+        if (efd < 0) {
+            throw errno_exception(errno);
+        }
+        vm.add_irqfd(efd, irq_gsi);
+    }
+
+    uint64_t start_ns = time_ns();
+    std::thread vcpu_thr(vcpu_thread, std::ref(vcpu), guest_irq_pingpong,
+                         true);
+    std::thread backend(irq_backend, std::ref(vm), efd);
+    backend.join();
+    vcpu_thr.join();
+    uint64_t ns = time_ns() - start_ns;
+
+    if (use_irqfd) {
+        vm.remove_irqfd(efd, irq_gsi);
+        close(efd);
+    }
+    report(use_irqfd ? "irqfd rtt" : "signal_msi rtt", true, ns);
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+
+    while ((opt = getopt(ac, av, "S")) != -1) {
+        switch (opt) {
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("eventfd-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (optind < ac) {
+        iterations = atoi(av[optind]);
+    }
+}
+
+int test_main(int ac, char** av)
+{
+    parse_options(ac, av);
+    samples.resize(iterations);
+    scale = tsc_per_ns();
+
+    kvm::system sys;
+    if (show_stats && !stats_supported(sys, "eventfd-perf")) {
+        return 1;
+    }
+    kvm::vm vm(sys);
+    vm.create_irqchip();
+    std::vector<kvm_irq_routing_entry> routes;
+    routes.push_back(kvm::vm::msi_route(irq_gsi, identity::apic_page,
+                                        irq_vector));
+    vm.set_gsi_routing(routes);
+    mem_map memmap(vm);
+    // the kick page and the APIC page stay out of guest memory
+    identity::hole hole(const_cast<uint32_t*>(kick_addr), 2 * 4096);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        stats.add(vcpu);
+    }
+    auto phase_done = [&] {
+        if (show_stats) {
+            stats.print(stdout);
+            stats.start();
+        }
+    };
+    for (int mmio = 0; mmio < 2; ++mmio) {
+        for (int use_eventfd = 0; use_eventfd < 2; ++use_eventfd) {
+            run_kick(vm, vcpu, mmio, use_eventfd, true);
+            phase_done();
+            run_kick(vm, vcpu, mmio, use_eventfd, false);
+            phase_done();
+        }
+    }
+    run_irq(vm, vcpu, false);
+    phase_done();
+    run_irq(vm, vcpu, true);
+    phase_done();
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
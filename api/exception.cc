@@ -12,7 +12,7 @@ int errno_exception::errno() const
     return _errno;
 }
 
-const char *errno_exception::what()
+const char *errno_exception::what() const throw()
 {
     std::snprintf(_buf, sizeof _buf, "error: %s (%d)",
 		  std::strerror(_errno), _errno);
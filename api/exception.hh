@@ -7,10 +7,10 @@ class errno_exception : public std::exception {
 public:
     explicit errno_exception(int err_no);
     int errno() const;
-    virtual const char *what();
+    virtual const char *what() const throw();
 private:
     int _errno;
-    char _buf[1000];
+    mutable char _buf[1000];
 };
 
 int try_main(int (*main)(int argc, char** argv), int argc, char** argv,
@@ -0,0 +1,112 @@
+#include "guestmem.hh"
+#include "exception.hh"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace {
+
+const char* backing_names[] = {
+    "anon", "thp", "hugetlb-2m", "hugetlb-1g", "memfd",
+};
+
+}
+
+size_t guest_memory::page_size(backing b)
+{
+    switch (b) {
+    case thp:
+    case hugetlb_2m:
+        return 2 << 20;
+    case hugetlb_1g:
+        return 1 << 30;
+    default:
+        return 4096;
+    }
+}
+
+const char* guest_memory::name(backing b)
+{
+    return b < nr_backings ? backing_names[b] : "unknown";
+}
+
+bool guest_memory::parse(const char* s, backing& b)
+{
+    for (int i = 0; i < nr_backings; ++i) {
+        if (strcmp(s, backing_names[i]) == 0) {
+            b = backing(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+guest_memory::guest_memory(size_t size, backing b)
+    : _backing(b)
+    , _size((size + page_size(b) - 1) & ~(page_size(b) - 1))
+    , _address()
+    , _map()
+    , _map_size(_size)
+    , _fd(-1)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    switch (b) {
+    case thp:
+        // over-allocate so the start can be aligned to a huge page
+        _map_size += page_size(b);
+        break;
+    case hugetlb_2m:
+        flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+        break;
+    case hugetlb_1g:
+        flags |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+        break;
+    case memfd:
+        _fd = syscall(__NR_memfd_create, "guest-memory", 0);
+        if (_fd == -1) {
+            throw errno_exception(errno);
+        }
+        if (ftruncate(_fd, _size) == -1) {
+            int err = errno;
+            close(_fd);
+            throw errno_exception(err);
+        }
+        flags = MAP_SHARED;
+        break;
+    default:
+        break;
+    }
+
+    _map = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, flags, _fd, 0);
+    if (_map == MAP_FAILED) {
+        int err = errno;
+        if (_fd != -1) {
+            close(_fd);
+        }
+        throw errno_exception(err);
+    }
+    _address = _map;
+
+    if (b == thp) {
+        uintptr_t align = page_size(b);
+        uintptr_t addr = reinterpret_cast<uintptr_t>(_map);
+        _address = reinterpret_cast<void*>((addr + align - 1) & ~(align - 1));
+        madvise(_address, _size, MADV_HUGEPAGE);
+    } else if (b == anon) {
+        madvise(_address, _size, MADV_NOHUGEPAGE);
+    }
+}
+
+guest_memory::~guest_memory()
+{
+    munmap(_map, _map_size);
+    if (_fd != -1) {
+        close(_fd);
+    }
+}
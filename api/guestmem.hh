@@ -0,0 +1,42 @@
+#ifndef API_GUESTMEM_HH
+#define API_GUESTMEM_HH
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Host memory that backs guest RAM.  The backing decides which host page
+// size KVM can use for its own mappings, so it is selectable to compare
+// fault and dirty logging costs.
+class guest_memory {
+public:
+    enum backing {
+        anon,           // private anonymous memory, THP disabled
+        thp,            // private anonymous memory, MADV_HUGEPAGE
+        hugetlb_2m,     // MAP_HUGETLB with 2M pages
+        hugetlb_1g,     // MAP_HUGETLB with 1G pages
+        memfd,          // shared memory from memfd_create()
+        nr_backings,
+    };
+    // size is rounded up to the backing's page size
+    guest_memory(size_t size, backing b = anon);
+    ~guest_memory();
+    guest_memory(const guest_memory&) = delete;
+    guest_memory& operator=(const guest_memory&) = delete;
+    void* address() const { return _address; }
+    size_t size() const { return _size; }
+    backing type() const { return _backing; }
+    size_t page_size() const { return page_size(_backing); }
+    static size_t page_size(backing b);
+    static const char* name(backing b);
+    // Parse a name() back to a backing; returns false if unknown.
+    static bool parse(const char* s, backing& b);
+private:
+    backing _backing;
+    size_t _size;
+    void* _address;
+    void* _map;
+    size_t _map_size;
+    int _fd;
+};
+
+#endif
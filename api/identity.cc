@@ -3,6 +3,12 @@
 #include "exception.hh"
 #include <stdlib.h>
 #include <stdio.h>
+#include <cpuid.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <stdexcept>
 
 namespace identity {
 
@@ -18,34 +24,320 @@ hole::hole(void* address, size_t size)
 {
 }
 
+hole::hole(const guest_memory& mem)
+    : address(mem.address()), size(mem.size())
+{
+}
+
+namespace {
+
+const uint64_t gib = 1ULL << 30;
+
+// A range of host virtual addresses and where it sits in guest physical
+// memory.
+struct region {
+    uint64_t va;
+    uint64_t size;
+    uint64_t gpa;
+};
+
+// The guest's view of this process.  It is shared by all identity VMs,
+// so that every vcpu can use the same page tables and host pointers
+// mean the same thing in all of them.
+class address_space {
+public:
+    typedef std::function<void (const region& r)> user;
+    address_space();
+    void set_slack(uint64_t below, uint64_t above);
+    // Make sure va is covered, rescanning the process's mappings if not.
+    void cover(uint64_t va);
+    // Tell u about every region, now and as they are added, until
+    // detach(key).
+    void attach(const void* key, user u);
+    void detach(const void* key);
+    uint64_t gpa(uint64_t va);
+#ifdef __x86_64__
+    uint64_t cr3() { return gpa(reinterpret_cast<uintptr_t>(_pml4)); }
+#endif
+private:
+    // Make sure everything currently mapped by the process is covered.
+    void update();
+    void add_region(uint64_t va, uint64_t size);
+    void map_region(const region& r);
+    uint64_t* table(uint64_t* entry, uint64_t key);
+    const region* find(uint64_t va) const;
+private:
+    // held by all public methods
+    std::mutex _mutex;
+    std::vector<region> _regions;
+    std::vector<std::pair<const void*, user> > _users;
+#ifdef __x86_64__
+    // new mappings usually appear right below existing ones (mmap) or
+    // right above (brk), so cover some of that space in advance
+    uint64_t _slack_below;
+    uint64_t _slack_above;
+    // enough page tables for 16T of 2M pages; only used ones are touched
+    static const size_t max_tables = 16 * 1024 + 512 + 1;
+    uint64_t _next_gpa;
+    uint64_t _gpa_limit;
+    uint64_t* _pool;
+    size_t _nr_tables;
+    uint64_t* _pml4;
+    // the page table each PML4 or PDPT entry points to
+    std::map<uint64_t, uint64_t*> _tables;
+#endif
+};
+
+address_space& the_address_space()
+{
+    static address_space as;
+    return as;
+}
+
+#ifdef __x86_64__
+
+address_space::address_space()
+    : _slack_below(32 * gib), _slack_above(1 * gib), _next_gpa(), _nr_tables()
+{
+    unsigned eax, ebx, ecx, edx;
+    __cpuid(0x80000008, eax, ebx, ecx, edx);
+    _gpa_limit = 1ULL << (eax & 0xff);
+
+    // allocate before the first scan, so the tables map themselves
+    void* pool = mmap(NULL, max_tables * 4096, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED) {
+        throw errno_exception(errno);
+    }
+    _pool = static_cast<uint64_t*>(pool);
+    _pml4 = table(NULL, 0);
+}
+
+// The table an entry points to, allocating it if the entry is empty;
+// key identifies the entry among all PML4 and PDPT entries.
+uint64_t* address_space::table(uint64_t* entry, uint64_t key)
+{
+    if (entry && *entry) {
+        return _tables[key];
+    }
+    if (_nr_tables == max_tables) {
+        throw std::runtime_error("identity: out of page tables");
+    }
+    uint64_t* t = &_pool[_nr_tables++ * 512];
+    if (entry) {
+        uint64_t va = reinterpret_cast<uintptr_t>(t);
+        const region* r = find(va);
+        *entry = (r->gpa + (va - r->va)) | 7; // P, RW, U
+        _tables[key] = t;
+    }
+    return t;
+}
+
+void address_space::set_slack(uint64_t below, uint64_t above)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _slack_below = below;
+    _slack_above = above;
+}
+
+void address_space::update()
+{
+    // the low 4G stay identity mapped, for the APIC and the TSS
+    std::vector<std::pair<uint64_t, uint64_t> > spans;
+    spans.push_back(std::make_pair(0, 4 * gib));
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (!maps) {
+        throw errno_exception(errno);
+    }
+    unsigned long long start, end;
+    while (fscanf(maps, "%llx-%llx%*[^\n]", &start, &end) == 2) {
+        if (end > (1ULL << 47)) {
+            continue; // vsyscall
+        }
+        start = start & ~(gib - 1);
+        start = start > _slack_below ? start - _slack_below : 0;
+        end = std::min(((end + gib - 1) & ~(gib - 1)) + _slack_above,
+                       1ULL << 47);
+        spans.push_back(std::make_pair(start, end));
+    }
+    fclose(maps);
+
+    std::sort(spans.begin(), spans.end());
+    size_t nr_old = _regions.size();
+    uint64_t next = 0;
+    for (auto& span : spans) {
+        for (uint64_t va = std::max(span.first, next); va < span.second; ) {
+            const region* r = find(va);
+            if (r) {
+                va = r->va + r->size;
+                continue;
+            }
+            uint64_t size = span.second - va;
+            for (auto& r : _regions) {
+                if (r.va > va) {
+                    size = std::min(size, r.va - va);
+                }
+            }
+            add_region(va, size);
+            va += size;
+        }
+        next = std::max(next, span.second);
+    }
+
+    // only now are the page tables themselves sure to have a gpa
+    for (size_t i = nr_old; i < _regions.size(); ++i) {
+        map_region(_regions[i]);
+    }
+    for (size_t i = nr_old; i < _regions.size(); ++i) {
+        for (auto& u : _users) {
+            u.second(_regions[i]);
+        }
+    }
+}
+
+void address_space::add_region(uint64_t va, uint64_t size)
+{
+    region r = { va, size, va ? _next_gpa : 0 };
+    if (r.gpa + size > _gpa_limit) {
+        throw std::runtime_error("identity: guest physical address space full");
+    }
+    _next_gpa = std::max(_next_gpa, r.gpa + size);
+    _regions.push_back(r);
+}
+
+// 2M pages, as not every host lets guests use 1G pages.  Entries are
+// only ever added, so vcpus already running on the tables are not
+// disturbed.
+void address_space::map_region(const region& r)
+{
+    const uint64_t mib2 = 2 << 20;
+    for (uint64_t off = 0; off < r.size; off += mib2) {
+        uint64_t va = r.va + off;
+        uint64_t* pdpt = table(&_pml4[va >> 39 & 511], va >> 39);
+        uint64_t* pd = table(&pdpt[va >> 30 & 511], (1ULL << 20) | va >> 30);
+        pd[va >> 21 & 511] = (r.gpa + off) | 0x87; // P, RW, U, PS
+    }
+}
+
+uint64_t address_space::gpa(uint64_t va)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const region* r = find(va);
+    if (!r) {
+        // mapped since the last scan, perhaps
+        update();
+        r = find(va);
+    }
+    if (!r) {
+        throw std::out_of_range("identity: address not mapped in guest");
+    }
+    return r->gpa + (va - r->va);
+}
+
+#else
+
+// Unpaged: guest physical addresses are the host's virtual addresses.
+address_space::address_space()
+{
+    region r = { 0, 1ULL << 32, 0 };
+    _regions.push_back(r);
+}
+
+void address_space::set_slack(uint64_t below, uint64_t above)
+{
+}
+
+void address_space::update()
+{
+}
+
+uint64_t address_space::gpa(uint64_t va)
+{
+    return va;
+}
+
+#endif
+
+void address_space::cover(uint64_t va)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!find(va)) {
+        update();
+    }
+}
+
+void address_space::attach(const void* key, user u)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    update();
+    for (auto& r : _regions) {
+        u(r);
+    }
+    _users.push_back(std::make_pair(key, u));
+}
+
+void address_space::detach(const void* key)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto it = _users.begin(); it != _users.end(); ++it) {
+        if (it->first == key) {
+            _users.erase(it);
+            return;
+        }
+    }
+}
+
+const region* address_space::find(uint64_t va) const
+{
+    for (auto& r : _regions) {
+        if (va >= r.va && va - r.va < r.size) {
+            return &r;
+        }
+    }
+    return NULL;
+}
+
+}
+
+uint64_t gpa(const void* p)
+{
+    return the_address_space().gpa(reinterpret_cast<uintptr_t>(p));
+}
+
+void set_address_slack(uint64_t below, uint64_t above)
+{
+    the_address_space().set_slack(below, above);
+}
+
 vm::vm(kvm::vm& vm, mem_map& mmap, hole h)
+    : _mmap(mmap)
 {
+#ifdef __x86_64__
+    // KVM wants the TSS below 4G; nothing lives at this address
+    tss = NULL;
+    uint64_t tss_addr = 0xfeffc000;
+#else
     int ret = posix_memalign(&tss, 4096, 4 * 4096);
     if (ret) {
         throw errno_exception(ret);
     }
-
-    uint64_t hole_gpa = reinterpret_cast<uintptr_t>(h.address);
-    char* hole_hva = static_cast<char*>(h.address);
     uint64_t tss_addr = reinterpret_cast<uintptr_t>(tss);
-    uint64_t tss_end = tss_addr + 4 * 4096;
-    uint64_t hole_end = hole_gpa + h.size;
+#endif
 
-    if (hole_gpa < tss_addr) {
-        if (hole_gpa) {
-            _slots.push_back(mem_slot_ptr(new mem_slot(mmap, 0, hole_gpa, NULL)));
-        }
-        _slots.push_back(mem_slot_ptr(new mem_slot(mmap, hole_end, tss_addr - hole_end,
-						   hole_hva + h.size)));
-        _slots.push_back(mem_slot_ptr(new mem_slot(mmap, tss_end, (uint32_t)-tss_end,
-						   (char*)tss + 4 * 4096)));
-    } else {
-        _slots.push_back(mem_slot_ptr(new mem_slot(mmap, 0, tss_addr, NULL)));
-        _slots.push_back(mem_slot_ptr(new mem_slot(mmap, tss_end, hole_gpa - tss_end,
-						   (char*)tss + 4 * 4096)));
-        _slots.push_back(mem_slot_ptr(new mem_slot(mmap, hole_end, (uint32_t)-hole_end,
-						   hole_hva + h.size)));
-    }
+    // everything except the hole and the TSS is guest memory
+    _excluded.push_back(std::make_pair(reinterpret_cast<uintptr_t>(h.address),
+                                       h.size));
+    _excluded.push_back(std::make_pair(tss_addr, 4 * 4096));
+#ifdef __x86_64__
+    // KVM rejects slots that reach the very top of user space
+    _excluded.push_back(std::make_pair((1ULL << 47) - 4096, 4096));
+#endif
+    std::sort(_excluded.begin(), _excluded.end());
+
+    // memory the process maps later gets its slots as it is covered
+    the_address_space().attach(this, [this] (const region& r) {
+        add_slots(r.va, r.size, r.gpa);
+    });
 
     vm.set_tss_addr(tss_addr);
     vm.set_ept_identity_map_addr(tss_addr + 3 * 4096);
@@ -53,9 +345,206 @@ vm::vm(kvm::vm& vm, mem_map& mmap, hole h)
 
 vm::~vm()
 {
+    the_address_space().detach(this);
     free(tss);
 }
 
+void vm::add_slots(uint64_t va, uint64_t size, uint64_t gpa)
+{
+    auto add_slot = [&] (uint64_t start, uint64_t end) {
+        void* hva = reinterpret_cast<void*>(uintptr_t(start));
+        _slots.push_back(mem_slot_ptr(new mem_slot(_mmap, gpa + (start - va),
+                                                   end - start, hva)));
+    };
+    uint64_t start = va, end = va + size;
+    for (auto& e : _excluded) {
+        uint64_t e_end = e.first + e.second;
+        if (!e.second || e_end <= start || e.first >= end) {
+            continue;
+        }
+        if (e.first > start) {
+            add_slot(start, e.first);
+        }
+        start = e_end;
+    }
+    if (start < end) {
+        add_slot(start, end);
+    }
+}
+
+// Guest interrupt entry: save the caller-saved registers, align the stack
+// as the ABI wants, let irq_dispatch() do the work and return to the
+// interrupted code.
+extern "C" void identity_irq_entry();
+extern "C" void identity_irq_dispatch();
+extern "C" bool identity_use_xsave;
+
+bool identity_use_xsave;
+
+asm(".pushsection .text\n"
+    "identity_irq_entry:\n"
+#ifdef __x86_64__
+    // runs on the IST stack; C++ code may use any SSE/AVX register, so
+    // those are saved too (with a zeroed XSAVE header, as XRSTOR wants)
+    "push %rbp; mov %rsp, %rbp\n"
+    "push %rax; push %rcx; push %rdx; push %rsi; push %rdi\n"
+    "push %r8; push %r9; push %r10; push %r11\n"
+    "sub $4096, %rsp; and $-64, %rsp\n"
+    "cmpb $0, identity_use_xsave(%rip); je 1f\n"
+    "xor %eax, %eax; lea 512(%rsp), %rdi; mov $8, %ecx; cld; rep stosq\n"
+    "mov $-1, %eax; mov $-1, %edx; xsave64 (%rsp); jmp 2f\n"
+    "1: fxsave64 (%rsp)\n"
+    "2: call identity_irq_dispatch\n"
+    "cmpb $0, identity_use_xsave(%rip); je 1f\n"
+    "mov $-1, %eax; mov $-1, %edx; xrstor64 (%rsp); jmp 2f\n"
+    "1: fxrstor64 (%rsp)\n"
+    "2: lea -72(%rbp), %rsp\n"
+    "pop %r11; pop %r10; pop %r9; pop %r8\n"
+    "pop %rdi; pop %rsi; pop %rdx; pop %rcx; pop %rax\n"
+    "pop %rbp\n"
+    "iretq\n"
+#else
+    "pusha\n"
+    "mov %esp, %ebp; and $-16, %esp\n"
+    "cld\n"
+    "call identity_irq_dispatch\n"
+    "mov %ebp, %esp\n"
+    "popa\n"
+    "iret\n"
+#endif
+    ".popsection");
+
+// The vcpu running on this thread.  The guest shares the thread's TLS, so
+// setting it on the host is enough, and covers interrupts that arrive
+// before thunk() runs.
+static __thread vcpu* current;
+
+void irq_dispatch()
+{
+    vcpu* zis = current;
+    if (zis && zis->_irq_handler) {
+        zis->_irq_handler();
+    }
+    *reinterpret_cast<volatile uint32_t*>(apic_page + 0xb0) = 0; // EOI
+}
+
+extern "C" void identity_irq_dispatch()
+{
+    irq_dispatch();
+}
+
+// Flat 4GB segment descriptor, or a 64-bit code segment
+static uint64_t segment_desc(uint8_t type, uint8_t dpl, bool l = false)
+{
+    uint64_t access = 0x90 | (dpl << 5) | type; // present, code/data
+    uint64_t flags = l ? 0xa : 0xc; // G, and L or D/B
+    return 0xffff | (access << 40) | (0xfULL << 48) | (flags << 52);
+}
+
+#ifdef __x86_64__
+
+static const std::vector<kvm_cpuid_entry2>& supported_cpuid(kvm::system& sys)
+{
+    static std::vector<kvm_cpuid_entry2> cpuid = sys.supported_cpuid();
+    return cpuid;
+}
+
+static const kvm_cpuid_entry2* cpuid_entry(
+    const std::vector<kvm_cpuid_entry2>& cpuid, uint32_t function,
+    uint32_t index = 0)
+{
+    for (auto& e : cpuid) {
+        if (e.function == function && e.index == index) {
+            return &e;
+        }
+    }
+    return NULL;
+}
+
+// Long mode, and XSAVE if there is one, must be visible in the guest's
+// CPUID before KVM accepts the matching EFER and CR4/XCR0 bits.
+void vcpu::setup_cpuid()
+{
+    const std::vector<kvm_cpuid_entry2>& cpuid = supported_cpuid(_vcpu.sys());
+    const kvm_cpuid_entry2* leaf1 = cpuid_entry(cpuid, 1);
+    const kvm_cpuid_entry2* ext1 = cpuid_entry(cpuid, 0x80000001);
+    const kvm_cpuid_entry2* xsave = cpuid_entry(cpuid, 0xd);
+    if (!ext1 || !(ext1->edx & (1 << 29))) {
+        throw std::runtime_error("identity: no long mode in guest CPUID");
+    }
+    if (_vcpu.cpuid().empty()) {
+        _vcpu.set_cpuid(cpuid);
+    }
+
+    // without XSAVE only SSE is usable, so guest code must not end up in
+    // AVX variants of libc functions
+    identity_use_xsave = leaf1 && (leaf1->ecx & (1 << 26)) && xsave;
+    if (identity_use_xsave) {
+        // x87, SSE, AVX and AVX-512 state, whatever the host has
+        kvm_xcrs xcrs = { };
+        xcrs.nr_xcrs = 1;
+        xcrs.xcrs[0].xcr = 0;
+        xcrs.xcrs[0].value = (xsave->eax | uint64_t(xsave->edx) << 32) & 0xe7;
+        _vcpu.set_xcrs(xcrs);
+    }
+}
+
+void vcpu::setup_sregs()
+{
+    kvm_sregs sregs = { };
+    kvm_segment dseg = { };
+    dseg.base = 0; dseg.limit = -1U; dseg.type = 3; dseg.present = 1;
+    dseg.dpl = 3; dseg.db = 1; dseg.s = 1; dseg.l = 0; dseg.g = 1;
+    kvm_segment cseg = dseg;
+    cseg.type = 11; cseg.db = 0; cseg.l = 1;
+
+    sregs.cs = cseg; asm ("mov %%cs, %0" : "=rm"(sregs.cs.selector));
+    sregs.ds = dseg; asm ("mov %%ds, %0" : "=rm"(sregs.ds.selector));
+    sregs.es = dseg; asm ("mov %%es, %0" : "=rm"(sregs.es.selector));
+    sregs.fs = dseg; asm ("mov %%fs, %0" : "=rm"(sregs.fs.selector));
+    sregs.gs = dseg; asm ("mov %%gs, %0" : "=rm"(sregs.gs.selector));
+    sregs.ss = dseg; asm ("mov %%ss, %0" : "=rm"(sregs.ss.selector));
+
+    uint64_t fsbase;
+    asm ("mov %%fs:0, %0" : "=r"(fsbase));
+    sregs.fs.base = fsbase;
+
+    _gdt.resize(std::max(sregs.cs.selector, sregs.ss.selector) / 8 + 1);
+    _gdt[sregs.cs.selector / 8] = segment_desc(cseg.type, cseg.dpl, true);
+    _gdt[sregs.ss.selector / 8] = segment_desc(dseg.type, dseg.dpl);
+    sregs.gdt.base = reinterpret_cast<uintptr_t>(&_gdt[0]);
+    sregs.gdt.limit = _gdt.size() * 8 - 1;
+
+    // IST1 (at byte offset 36) is the interrupt stack
+    _irq_stack.resize(64 * 1024);
+    _tss.assign(13, 0);
+    uint64_t ist = reinterpret_cast<uintptr_t>(&*_irq_stack.end()) & ~15UL;
+    uint32_t* tss = reinterpret_cast<uint32_t*>(&_tss[0]);
+    tss[9] = ist;
+    tss[10] = ist >> 32;
+    sregs.tr.base = reinterpret_cast<uintptr_t>(&_tss[0]);
+    sregs.tr.limit = _tss.size() * 8 - 1;
+    sregs.tr.type = 11;
+    sregs.tr.s = 0;
+    sregs.tr.present = 1;
+
+    sregs.cr0 = 0x80010033; /* PE, MP, ET, NE, WP, PG */
+    sregs.cr3 = the_address_space().cr3();
+    sregs.cr4 = 0x620; /* PAE, OSFXSR, OSXMMEXCPT */
+    if (identity_use_xsave) {
+        sregs.cr4 |= 0x40000; /* OSXSAVE */
+    }
+    sregs.efer = 0x500; /* LME, LMA */
+    sregs.apic_base = 0xfee00000;
+    _vcpu.set_sregs(sregs);
+}
+
+#else
+
+void vcpu::setup_cpuid()
+{
+}
+
 void vcpu::setup_sregs()
 {
     kvm_sregs sregs = { };
@@ -76,6 +565,14 @@ void vcpu::setup_sregs()
     asm ("mov %%gs:0, %0" : "=r"(gsbase));
     sregs.gs.base = gsbase;
 
+    // Interrupt delivery reloads CS from the GDT, so give the guest one
+    // that matches the host selectors in use.
+    _gdt.resize(std::max(sregs.cs.selector, sregs.ss.selector) / 8 + 1);
+    _gdt[sregs.cs.selector / 8] = segment_desc(cseg.type, cseg.dpl);
+    _gdt[sregs.ss.selector / 8] = segment_desc(dseg.type, dseg.dpl);
+    sregs.gdt.base = reinterpret_cast<uintptr_t>(&_gdt[0]);
+    sregs.gdt.limit = _gdt.size() * 8 - 1;
+
     sregs.tr.base = reinterpret_cast<uintptr_t>(&*_stack.begin());
     sregs.tr.type = 11;
     sregs.tr.s = 0;
@@ -88,8 +585,11 @@ void vcpu::setup_sregs()
     _vcpu.set_sregs(sregs);
 }
 
+#endif
+
 void vcpu::thunk(vcpu* zis)
 {
+    current = zis;
     zis->_guest_func();
     asm volatile("outb %%al, %%dx" : : "a"(0), "d"(0));
 }
@@ -101,18 +601,77 @@ void vcpu::setup_regs()
     regs.rsp = reinterpret_cast<ulong>(&*_stack.end());
     regs.rsp &= ~15UL;
     ulong* sp = reinterpret_cast<ulong *>(regs.rsp);
+#ifdef __x86_64__
+    regs.rdi = reinterpret_cast<ulong>((char*)this);
+#else
     *--sp = reinterpret_cast<ulong>((char*)this);
+#endif
     *--sp = 0;
     regs.rsp = reinterpret_cast<ulong>(sp);
     regs.rip = reinterpret_cast<ulong>(&vcpu::thunk);
-    printf("rip %llx\n", regs.rip);
     _vcpu.set_regs(regs);
 }
 
+void vcpu::enable_interrupts(std::function<void ()> irq_handler)
+{
+    _irq_handler = irq_handler;
+    current = this;
+    // a 64-bit guest at CPL 3 does not get its interrupts delivered
+    enter_cpl0();
+
+    // interrupt gates; vectors 0-31 stay not-present, so that exceptions
+    // still end in a shutdown exit
+    kvm_sregs sregs = _vcpu.sregs();
+    uint64_t entry = reinterpret_cast<uintptr_t>(identity_irq_entry);
+    uint64_t gate = (entry & 0xffff) | (uint64_t(sregs.cs.selector) << 16)
+        | (0xeeULL << 40) | ((entry >> 16 & 0xffff) << 48);
+#ifdef __x86_64__
+    // 16-byte gates, on IST1
+    gate |= 1ULL << 32;
+    _idt.assign(512, 0);
+    for (int vec = 32; vec < 256; ++vec) {
+        _idt[vec * 2] = gate;
+        _idt[vec * 2 + 1] = entry >> 32;
+    }
+#else
+    _idt.assign(256, 0);
+    for (int vec = 32; vec < 256; ++vec) {
+        _idt[vec] = gate;
+    }
+#endif
+    sregs.idt.base = reinterpret_cast<uintptr_t>(&_idt[0]);
+    sregs.idt.limit = _idt.size() * 8 - 1;
+    sregs.apic_base |= 0x800; // setup_sregs() leaves the APIC disabled
+    _vcpu.set_sregs(sregs);
+
+    kvm_lapic_state lapic = _vcpu.lapic();
+    uint32_t* svr = reinterpret_cast<uint32_t*>(&lapic.regs[0xf0]);
+    *svr = 0x1ff; // APIC enabled, spurious vector 0xff
+    _vcpu.set_lapic(lapic);
+}
+
+void vcpu::enter_cpl0()
+{
+    kvm_sregs sregs = _vcpu.sregs();
+    sregs.cs.dpl = sregs.ss.dpl = 0;
+    sregs.cs.selector &= ~3;
+    sregs.ss.selector &= ~3;
+    _vcpu.set_sregs(sregs);
+    // interrupts and IRET check the descriptor privilege too
+    _gdt[sregs.cs.selector / 8] &= ~(3ULL << 45);
+    _gdt[sregs.ss.selector / 8] &= ~(3ULL << 45);
+}
+
 vcpu::vcpu(kvm::vcpu& vcpu, std::function<void ()> guest_func,
            unsigned long stack_size)
     : _vcpu(vcpu), _guest_func(guest_func), _stack(stack_size)
 {
+    // the guest runs on _stack, with this thread's TLS
+    address_space& as = the_address_space();
+    as.cover(reinterpret_cast<uintptr_t>(&_stack.front()));
+    as.cover(reinterpret_cast<uintptr_t>(&_stack.back()));
+    as.cover(reinterpret_cast<uintptr_t>(&current));
+    setup_cpuid();
     setup_sregs();
     setup_regs();
 }
@@ -3,15 +3,33 @@
 
 #include "kvmxx.hh"
 #include "memmap.hh"
+#include "guestmem.hh"
 #include <functional>
 #include <memory>
 #include <vector>
 
 namespace identity {
 
+// Guest physical address of host memory at p.  32-bit guests run
+// unpaged, so this is p itself; 64-bit guests map host virtual
+// addresses 1:1, but the physical address space is usually narrower
+// than the host's, so the memory in use is packed into it instead.
+uint64_t gpa(const void* p);
+
+// 64-bit identity VMs cover every mapping of the process, rounded out to
+// 1G and widened by this much below and above, so that memory the
+// process maps later (thread stacks, malloc arenas) is usually covered
+// already.  Each cluster of mappings thus takes below + above + 2G of
+// guest physical space; programs that want very large slots can shrink
+// the slack before creating their first identity::vm.  Memory mapped
+// later outside of it becomes guest memory (in every identity VM) once
+// gpa() is asked about it, or an identity::vcpu runs on it.
+void set_address_slack(uint64_t below, uint64_t above);
+
 struct hole {
     hole();
     hole(void* address, size_t size);
+    explicit hole(const guest_memory& mem);
     void* address;
     size_t size;
 };
@@ -21,23 +39,50 @@ public:
     vm(kvm::vm& vm, mem_map& mmap, hole address_space_hole = hole());
     ~vm();
 private:
+    // slot what is not excluded of host memory [va, va + size) at gpa
+    void add_slots(uint64_t va, uint64_t size, uint64_t gpa);
+private:
+    mem_map& _mmap;
     void *tss;
+    // ranges of host addresses that stay out of guest memory
+    std::vector<std::pair<uint64_t, uint64_t> > _excluded;
     typedef std::shared_ptr<mem_slot> mem_slot_ptr;
     std::vector<mem_slot_ptr> _slots;
 };
 
+// The guest's local APIC page; a VM with an in-kernel irqchip must leave
+// it out of guest memory, e.g. by putting it inside the hole.
+const uint32_t apic_page = 0xfee00000;
+
 class vcpu {
 public:
     vcpu(kvm::vcpu& vcpu, std::function<void ()> guest_func,
 	 unsigned long stack_size = 256 * 1024);
+    // Enable the in-kernel local APIC and run irq_handler in the guest for
+    // every external interrupt (vectors 32-255), followed by an EOI.  The
+    // guest runs at CPL 0 from then on, see enter_cpl0().  The vcpu must
+    // be constructed on the thread that runs it.
+    void enable_interrupts(std::function<void ()> irq_handler);
+    // Run the guest at CPL 0 instead of with the host's user segments,
+    // for HLT, VMCALL and the like.
+    void enter_cpl0();
 private:
     static void thunk(vcpu* vcpu);
     void setup_regs();
     void setup_sregs();
+    void setup_cpuid();
+    friend void irq_dispatch();
 private:
     kvm::vcpu& _vcpu;
     std::function<void ()> _guest_func;
+    std::function<void ()> _irq_handler;
     std::vector<char> _stack;
+    std::vector<uint64_t> _gdt;
+    std::vector<uint64_t> _idt;
+    // 64-bit TSS, whose only use is a separate interrupt stack so that
+    // interrupts don't clobber the red zone of the code they interrupt
+    std::vector<uint64_t> _tss;
+    std::vector<char> _irq_stack;
 };
 
 }
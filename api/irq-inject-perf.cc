@@ -0,0 +1,327 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "memmap.hh"
+#include "runloop.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const uint32_t irq_vector = 0x40;
+int max_vcpus = 0;	// 0 = half the number of CPUs
+unsigned nr_irqs = 10000;
+bool show_stats = false;
+
+// How the host raises the interrupt.
+enum mechanism {
+    via_msi,		// KVM_SIGNAL_MSI straight to the vcpu's local APIC
+    via_irq_line,	// KVM_IRQ_LINE on an in-kernel IOAPIC pin
+    via_interrupt,	// KVM_INTERRUPT from the vcpu thread, split irqchip
+    nr_mechanisms,
+};
+
+const char* mechanism_names[nr_mechanisms] = {
+    "KVM_SIGNAL_MSI", "KVM_IRQ_LINE", "KVM_INTERRUPT",
+};
+
+// IOAPIC pin, and GSI, for vcpu i: GSI 0 is routed to pin 2, so both
+// are left out.
+uint32_t ioapic_pin(int i)
+{
+    return i == 0 ? 1 : i + 2;
+}
+
+const int nr_ioapic_vcpus = KVM_IOAPIC_NUM_PINS - 2;
+
+// One vcpu and the host thread that interrupts it.  The fields the
+// two threads poll come first and are kept off other vcpus' lines.
+struct vcpu_ctx {
+    volatile uint32_t nr_seen;
+    volatile bool pending;
+    volatile bool ready;
+    char pad[64];
+    mechanism how;
+    int id;
+    kvm::vm* vm;
+    std::unique_ptr<kvm::vcpu> vcpu;
+    pthread_t thread;
+    latency_histogram latency;
+};
+
+// The kvm_run of the vcpu this thread runs, for kick().
+__thread kvm_run* kicked_run;
+
+// SIGUSR1 handler.  The signal makes a running KVM_RUN return with
+// EINTR; immediate_exit covers a signal that arrives just before it.
+void kick(int sig)
+{
+    if (kicked_run) {
+        kicked_run->immediate_exit = 1;
+    }
+}
+
+void count_irq(vcpu_ctx* ctx)
+{
+    ctx->nr_seen = ctx->nr_seen + 1;
+}
+
+// Guest: sleep until all interrupts have arrived.  STI;HLT is atomic, so
+// an interrupt that comes after the check still wakes the vcpu.
+void guest_halt(vcpu_ctx* ctx)
+{
+    asm volatile("cli");
+    while (ctx->nr_seen < nr_irqs) {
+        asm volatile("sti; hlt; cli" : : : "memory");
+    }
+    asm volatile("sti");
+}
+
+// KVM_INTERRUPT only works from the thread that runs the vcpu, between
+// two KVM_RUNs, so the injector kicks the vcpu out of the guest first,
+// the way QEMU does for a userspace PIC.
+void run_kicked(vcpu_ctx* ctx)
+{
+    kicked_run = ctx->vcpu->shared();
+    do {
+        if (ctx->pending) {
+            ctx->pending = false;
+            ctx->vcpu->interrupt(irq_vector);
+        }
+    } while (!ctx->vcpu->run_interruptible());
+    kicked_run = nullptr;
+}
+
+void vcpu_thread(vcpu_ctx* ctx)
+{
+    identity::vcpu guest(*ctx->vcpu, std::bind(guest_halt, ctx));
+    // application processors would otherwise wait for INIT/SIPI
+    kvm_mp_state runnable = { KVM_MP_STATE_RUNNABLE };
+    ctx->vcpu->set_mp_state(runnable);
+    guest.enable_interrupts(std::bind(count_irq, ctx));
+    // LINT0 takes KVM_INTERRUPT's ExtINT; otherwise mask it, since the
+    // in-kernel PIC sees the IOAPIC's first 16 GSIs as well.
+    kvm_lapic_state lapic = ctx->vcpu->lapic();
+    uint32_t* lvt0 = reinterpret_cast<uint32_t*>(&lapic.regs[0x350]);
+    *lvt0 = ctx->how == via_interrupt ? 0x700 : 0x10000;
+    ctx->vcpu->set_lapic(lapic);
+    ctx->thread = pthread_self();
+    ctx->ready = true;
+    if (ctx->how == via_interrupt) {
+        run_kicked(ctx);
+    } else {
+        ctx->vcpu->run();
+    }
+}
+
+void inject(vcpu_ctx* ctx)
+{
+    switch (ctx->how) {
+    case via_msi:
+        ctx->vm->signal_msi(identity::apic_page | ctx->id << 12, irq_vector);
+        break;
+    case via_irq_line:
+        ctx->vm->irq_line(ioapic_pin(ctx->id), true);
+        break;
+    case via_interrupt:
+        ctx->pending = true;
+        pthread_kill(ctx->thread, SIGUSR1);
+        break;
+    default:
+        break;
+    }
+}
+
+// Injector: raise one interrupt at a time and time it until the guest's
+// handler has run.
+void inject_thread(vcpu_ctx* ctx)
+{
+    while (!ctx->ready) {
+        asm volatile("pause");
+    }
+    for (unsigned i = 0; i < nr_irqs; ++i) {
+        uint64_t start_ns = time_ns();
+        inject(ctx);
+        while (ctx->nr_seen != i + 1) {
+            asm volatile("pause");
+        }
+        ctx->latency.add(time_ns() - start_ns);
+        if (ctx->how == via_irq_line) {
+            // edge-triggered, so lower it for the next one
+            ctx->vm->irq_line(ioapic_pin(ctx->id), false);
+        }
+    }
+}
+
+// Send pin i's interrupts to vcpu i: fixed, physical, edge, unmasked.
+void route_pins(kvm::vm& vm, int nr_vcpus)
+{
+    kvm_irqchip chip = vm.irqchip_state(KVM_IRQCHIP_IOAPIC);
+    for (int i = 0; i < nr_vcpus; ++i) {
+        auto& entry = chip.chip.ioapic.redirtbl[ioapic_pin(i)];
+        entry.bits = 0;
+        entry.fields.vector = irq_vector;
+        entry.fields.dest_id = i;
+    }
+    vm.set_irqchip_state(chip);
+}
+
+void run(kvm::system& sys, mechanism how, int nr_vcpus)
+{
+    kvm::vm vm(sys);
+    if (how == via_interrupt) {
+        vm.create_split_irqchip(KVM_IOAPIC_NUM_PINS);
+    } else {
+        vm.create_irqchip();
+    }
+    mem_map memmap(vm);
+    // the in-kernel LAPIC page stays out of guest memory
+    identity::hole hole(reinterpret_cast<void*>(identity::apic_page), 4096);
+    identity::vm ident_vm(vm, memmap, hole);
+
+    std::vector<std::unique_ptr<vcpu_ctx> > ctxs;
+    for (int i = 0; i < nr_vcpus; ++i) {
+        std::unique_ptr<vcpu_ctx> ctx(new vcpu_ctx());
+        ctx->how = how;
+        ctx->id = i;
+        ctx->vm = &vm;
+        ctx->vcpu.reset(new kvm::vcpu(vm, i));
+        ctxs.push_back(std::move(ctx));
+    }
+    if (how == via_irq_line) {
+        route_pins(vm, nr_vcpus);
+    }
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        for (auto& ctx : ctxs) {
+            stats.add(*ctx->vcpu);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    uint64_t start_ns = time_ns();
+    for (auto& ctx : ctxs) {
+        threads.push_back(std::thread(vcpu_thread, ctx.get()));
+        threads.push_back(std::thread(inject_thread, ctx.get()));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    uint64_t ns = time_ns() - start_ns;
+
+    latency_histogram total;
+    for (auto& ctx : ctxs) {
+        total.merge(ctx->latency);
+    }
+    printf("%-15s %6d %12.0f %12.0f %12llu %12llu %12llu\n",
+           mechanism_names[how], nr_vcpus, nr_vcpus * nr_irqs * 1e9 / ns,
+           total.mean(), (unsigned long long)total.percentile(50),
+           (unsigned long long)total.percentile(99),
+           (unsigned long long)total.max());
+    if (show_stats) {
+        stats.print(stdout);
+    }
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+    long val;
+
+    while ((opt = getopt(ac, av, "v:n:S")) != -1) {
+        switch (opt) {
+        case 'v':
+        case 'n':
+            errno = 0;
+            val = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || val <= 0) {
+                printf("irq-inject-perf: Invalid number: -%c %s\n", opt, optarg);
+                exit(1);
+            }
+            if (opt == 'v') {
+                max_vcpus = val;
+            } else {
+                nr_irqs = val;
+            }
+            break;
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("irq-inject-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+    if (!sys.check_extension(KVM_CAP_IRQCHIP)) {
+        printf("irq-inject-perf: KVM_CAP_IRQCHIP not supported\n");
+        return 1;
+    }
+    if (show_stats && !stats_supported(sys, "irq-inject-perf")) {
+        return 1;
+    }
+    if (!max_vcpus) {
+        // each vcpu comes with a busy-waiting injector thread
+        max_vcpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN) / 2);
+    }
+    int kvm_max = sys.get_extension_int(KVM_CAP_MAX_VCPUS);
+    if (max_vcpus > kvm_max) {
+        printf("irq-inject-perf: KVM supports only %d vcpus\n", kvm_max);
+        max_vcpus = kvm_max;
+    }
+
+    struct sigaction sa = { };
+    sa.sa_handler = kick;	// no SA_RESTART, KVM_RUN must return
+    sigaction(SIGUSR1, &sa, nullptr);
+
+    bool supported[nr_mechanisms] = {
+        sys.check_extension(KVM_CAP_SIGNAL_MSI),
+        true,
+        sys.check_extension(KVM_CAP_SPLIT_IRQCHIP)
+            && sys.check_extension(KVM_CAP_IMMEDIATE_EXIT),
+    };
+    printf("irq-inject-perf: %u interrupts per vcpu, vector 0x%x\n",
+           nr_irqs, irq_vector);
+    printf("%-15s %6s %12s %12s %12s %12s %12s\n", "mechanism", "vcpus",
+           "irqs/sec", "mean ns", "p50 ns <=", "p99 ns <=", "max ns");
+    for (int m = 0; m < nr_mechanisms; ++m) {
+        if (!supported[m]) {
+            printf("%-15s not supported\n", mechanism_names[m]);
+            continue;
+        }
+        for (int n = 1; n <= max_vcpus; n *= 2) {
+            if (m == via_irq_line && n > nr_ioapic_vcpus) {
+                printf("%-15s %6d skipped, %d IOAPIC pins\n",
+                       mechanism_names[m], n, KVM_IOAPIC_NUM_PINS);
+                break;
+            }
+            run(sys, mechanism(m), n);
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
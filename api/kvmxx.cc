@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <memory>
 #include <algorithm>
+#include <stdexcept>
 
 namespace kvm {
 
@@ -18,31 +19,32 @@ static long check_error(long r)
 }
 
 fd::fd(int fd)
-    : _fd(fd)
+    : _fd(fd), _nr_ioctls(0)
 {
 }
 
 fd::fd(const fd& other)
-    : _fd(::dup(other._fd))
+    : _fd(::dup(other._fd)), _nr_ioctls(0)
 {
     check_error(_fd);
 }
 
 fd::fd(std::string device_node, int flags)
-    : _fd(::open(device_node.c_str(), flags))
+    : _fd(::open(device_node.c_str(), flags)), _nr_ioctls(0)
 {
     check_error(_fd);
 }
 
 long fd::ioctl(unsigned nr, long arg)
 {
+    ++_nr_ioctls;
     return check_error(::ioctl(_fd, nr, arg));
 }
 
 vcpu::vcpu(vm& vm, int id)
     : _vm(vm), _fd(vm._fd.ioctl(KVM_CREATE_VCPU, id)), _shared(NULL)
     , _mmap_size(_vm._system._fd.ioctl(KVM_GET_VCPU_MMAP_SIZE, 0))
-
+    , _dirty_ring(NULL), _sync_regs(0), _sync_valid(0), _xsave_size(0)
 {
     kvm_run *shared = static_cast<kvm_run*>(::mmap(NULL, _mmap_size,
 						   PROT_READ | PROT_WRITE,
@@ -52,20 +54,87 @@ vcpu::vcpu(vm& vm, int id)
 	throw errno_exception(errno);
     }
     _shared = shared;
+
+    if (_vm._dirty_ring_size) {
+	void *ring = ::mmap(NULL, _vm._dirty_ring_size,
+			    PROT_READ | PROT_WRITE, MAP_SHARED, _fd.get(),
+			    KVM_DIRTY_LOG_PAGE_OFFSET * ::getpagesize());
+	if (ring == MAP_FAILED) {
+	    int err = errno;
+	    munmap(_shared, _mmap_size);
+	    throw errno_exception(err);
+	}
+	_dirty_ring = static_cast<kvm_dirty_gfn*>(ring);
+    }
 }
 
 vcpu::~vcpu()
 {
+    if (_dirty_ring) {
+	munmap(_dirty_ring, _vm._dirty_ring_size);
+    }
     munmap(_shared, _mmap_size);
 }
 
+system& vcpu::sys()
+{
+    return _vm.sys();
+}
+
 void vcpu::run()
 {
     _fd.ioctl(KVM_RUN, 0);
+    _sync_valid = _sync_regs;
+}
+
+// Like run(), but returns false if KVM_RUN was cut short by a signal
+// or by kvm_run::immediate_exit, which is how another thread kicks the
+// vcpu out of the guest (e.g. to have it issue KVM_INTERRUPT, which
+// only the thread running the vcpu can do without waiting for the
+// next exit).  immediate_exit is cleared again in that case.
+bool vcpu::run_interruptible()
+{
+    if (::ioctl(_fd.get(), KVM_RUN, 0) == -1) {
+	if (errno != EINTR) {
+	    throw errno_exception(errno);
+	}
+	_shared->immediate_exit = 0;
+	return false;
+    }
+    _sync_valid = _sync_regs;
+    return true;
+}
+
+// Queue an external interrupt: with the local APIC in userspace it is
+// injected as is, with a split irqchip it arrives as ExtINT through
+// LINT0.
+void vcpu::interrupt(uint32_t vector)
+{
+    kvm_interrupt irq = { vector };
+    _fd.ioctlp(KVM_INTERRUPT, &irq);
+}
+
+kvm_run *vcpu::shared()
+{
+    return _shared;
+}
+
+// Have KVM_RUN exchange the given KVM_SYNC_X86_* fields through the
+// shared kvm_run page.  The accessors below then read the state KVM
+// stored on the last exit, and setters mark it dirty for the next entry,
+// instead of issuing an ioctl each.
+void vcpu::enable_sync_regs(uint64_t fields)
+{
+    _sync_regs = fields;
+    _sync_valid = 0;
+    _shared->kvm_valid_regs = fields;
 }
 
 kvm_regs vcpu::regs()
 {
+    if (_sync_valid & KVM_SYNC_X86_REGS) {
+	return _shared->s.regs.regs;
+    }
     kvm_regs regs;
     _fd.ioctlp(KVM_GET_REGS, &regs);
     return regs;
@@ -73,11 +142,20 @@ kvm_regs vcpu::regs()
 
 void vcpu::set_regs(const kvm_regs& regs)
 {
+    if (_sync_regs & KVM_SYNC_X86_REGS) {
+	_shared->s.regs.regs = regs;
+	_shared->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+	_sync_valid |= KVM_SYNC_X86_REGS;
+	return;
+    }
     _fd.ioctlp(KVM_SET_REGS, const_cast<kvm_regs*>(&regs));
 }
 
 kvm_sregs vcpu::sregs()
 {
+    if (_sync_valid & KVM_SYNC_X86_SREGS) {
+	return _shared->s.regs.sregs;
+    }
     kvm_sregs sregs;
     _fd.ioctlp(KVM_GET_SREGS, &sregs);
     return sregs;
@@ -85,9 +163,36 @@ kvm_sregs vcpu::sregs()
 
 void vcpu::set_sregs(const kvm_sregs& sregs)
 {
+    if (_sync_regs & KVM_SYNC_X86_SREGS) {
+	_shared->s.regs.sregs = sregs;
+	_shared->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+	_sync_valid |= KVM_SYNC_X86_SREGS;
+	return;
+    }
     _fd.ioctlp(KVM_SET_SREGS, const_cast<kvm_sregs*>(&sregs));
 }
 
+kvm_vcpu_events vcpu::vcpu_events()
+{
+    if (_sync_valid & KVM_SYNC_X86_EVENTS) {
+	return _shared->s.regs.events;
+    }
+    kvm_vcpu_events events;
+    _fd.ioctlp(KVM_GET_VCPU_EVENTS, &events);
+    return events;
+}
+
+void vcpu::set_vcpu_events(const kvm_vcpu_events& events)
+{
+    if (_sync_regs & KVM_SYNC_X86_EVENTS) {
+	_shared->s.regs.events = events;
+	_shared->kvm_dirty_regs |= KVM_SYNC_X86_EVENTS;
+	_sync_valid |= KVM_SYNC_X86_EVENTS;
+	return;
+    }
+    _fd.ioctlp(KVM_SET_VCPU_EVENTS, const_cast<kvm_vcpu_events*>(&events));
+}
+
 class vcpu::kvm_msrs_ptr {
 public:
     explicit kvm_msrs_ptr(size_t nmsrs);
@@ -108,7 +213,7 @@ vcpu::kvm_msrs_ptr::kvm_msrs_ptr(size_t nmsrs)
     }
 }
 
-std::vector<kvm_msr_entry> vcpu::msrs(std::vector<uint32_t> indices)
+std::vector<kvm_msr_entry> vcpu::msrs(const std::vector<uint32_t>& indices)
 {
     kvm_msrs_ptr msrs(indices.size());
     msrs->nmsrs = indices.size();
@@ -128,6 +233,248 @@ void vcpu::set_msrs(const std::vector<kvm_msr_entry>& msrs)
     _fd.ioctlp(KVM_SET_MSRS, _msrs.get());
 }
 
+kvm_lapic_state vcpu::lapic()
+{
+    kvm_lapic_state lapic;
+    _fd.ioctlp(KVM_GET_LAPIC, &lapic);
+    return lapic;
+}
+
+void vcpu::set_lapic(const kvm_lapic_state& lapic)
+{
+    _fd.ioctlp(KVM_SET_LAPIC, const_cast<kvm_lapic_state*>(&lapic));
+}
+
+// Without an in-kernel irqchip the local APIC is emulated by userspace
+// and there is no LAPIC state to get or set.
+bool vcpu::irqchip() const
+{
+    return _vm.irqchip();
+}
+
+kvm_mp_state vcpu::mp_state()
+{
+    kvm_mp_state state;
+    _fd.ioctlp(KVM_GET_MP_STATE, &state);
+    return state;
+}
+
+void vcpu::set_mp_state(const kvm_mp_state& state)
+{
+    _fd.ioctlp(KVM_SET_MP_STATE, const_cast<kvm_mp_state*>(&state));
+}
+
+kvm_debugregs vcpu::debugregs()
+{
+    kvm_debugregs dregs;
+    _fd.ioctlp(KVM_GET_DEBUGREGS, &dregs);
+    return dregs;
+}
+
+void vcpu::set_debugregs(const kvm_debugregs& dregs)
+{
+    _fd.ioctlp(KVM_SET_DEBUGREGS, const_cast<kvm_debugregs*>(&dregs));
+}
+
+kvm_fpu vcpu::fpu()
+{
+    kvm_fpu fpu;
+    _fd.ioctlp(KVM_GET_FPU, &fpu);
+    return fpu;
+}
+
+void vcpu::set_fpu(const kvm_fpu& fpu)
+{
+    _fd.ioctlp(KVM_SET_FPU, const_cast<kvm_fpu*>(&fpu));
+}
+
+// Size of the buffer get_xsave() fills: struct kvm_xsave, or more if
+// the guest can use state components beyond it (AMX tiles).
+unsigned vcpu::xsave_size()
+{
+    if (!_xsave_size) {
+	int size = _vm._fd.ioctl(KVM_CHECK_EXTENSION, KVM_CAP_XSAVE2);
+	_xsave_size = std::max<unsigned>(size, sizeof(kvm_xsave));
+    }
+    return _xsave_size;
+}
+
+void vcpu::get_xsave(kvm_xsave* xsave)
+{
+    if (xsave_size() > sizeof(kvm_xsave)) {
+	_fd.ioctlp(KVM_GET_XSAVE2, xsave);
+    } else {
+	_fd.ioctlp(KVM_GET_XSAVE, xsave);
+    }
+}
+
+// KVM_SET_XSAVE takes as much as KVM_GET_XSAVE2 returned.
+void vcpu::set_xsave(const kvm_xsave* xsave)
+{
+    _fd.ioctlp(KVM_SET_XSAVE, const_cast<kvm_xsave*>(xsave));
+}
+
+#ifdef KVM_PRE_FAULT_MEMORY
+// Map [gpa, gpa + size) into the TDP page tables before the guest
+// touches it.  KVM stops early on a pending signal or contention and
+// leaves the rest of the range in the struct, so keep going.
+void vcpu::pre_fault_memory(uint64_t gpa, uint64_t size)
+{
+    kvm_pre_fault_memory range = { };
+    range.gpa = gpa;
+    range.size = size;
+    while (range.size) {
+	if (::ioctl(_fd.get(), KVM_PRE_FAULT_MEMORY, &range) == -1
+	    && errno != EINTR && errno != EAGAIN) {
+	    throw errno_exception(errno);
+	}
+    }
+}
+#endif
+
+std::vector<kvm_cpuid_entry2> vcpu::cpuid()
+{
+    for (unsigned nent = 64; ; nent *= 2) {
+        std::vector<char> buf(sizeof(kvm_cpuid2)
+                              + nent * sizeof(kvm_cpuid_entry2));
+        kvm_cpuid2 *cpuid = reinterpret_cast<kvm_cpuid2*>(&buf[0]);
+        cpuid->nent = nent;
+        if (::ioctl(_fd.get(), KVM_GET_CPUID2, cpuid) == 0) {
+            return std::vector<kvm_cpuid_entry2>(cpuid->entries,
+                                                 cpuid->entries + cpuid->nent);
+        }
+        if (errno != E2BIG) {
+            throw errno_exception(errno);
+        }
+    }
+}
+
+// Once the vcpu has run, KVM only accepts the CPUID it already has.
+void vcpu::set_cpuid(const std::vector<kvm_cpuid_entry2>& entries)
+{
+    std::vector<char> buf(sizeof(kvm_cpuid2)
+                          + entries.size() * sizeof(kvm_cpuid_entry2));
+    kvm_cpuid2 *cpuid = reinterpret_cast<kvm_cpuid2*>(&buf[0]);
+    cpuid->nent = entries.size();
+    std::copy(entries.begin(), entries.end(), cpuid->entries);
+    _fd.ioctlp(KVM_SET_CPUID2, cpuid);
+}
+
+kvm_xcrs vcpu::xcrs()
+{
+    kvm_xcrs xcrs;
+    _fd.ioctlp(KVM_GET_XCRS, &xcrs);
+    return xcrs;
+}
+
+void vcpu::set_xcrs(const kvm_xcrs& xcrs)
+{
+    _fd.ioctlp(KVM_SET_XCRS, const_cast<kvm_xcrs*>(&xcrs));
+}
+
+// A new file descriptor for the vcpu's binary statistics, owned by the
+// caller.
+int vcpu::stats_fd()
+{
+    return _fd.ioctl(KVM_GET_STATS_FD, 0);
+}
+
+// The ring is shared by all vcpus of the VM and lives in the vcpu mmap
+// area, after kvm_run.
+kvm_coalesced_mmio_ring *vcpu::coalesced_mmio_ring()
+{
+    char *page = reinterpret_cast<char*>(_shared)
+	+ KVM_COALESCED_MMIO_PAGE_OFFSET * ::getpagesize();
+    return reinterpret_cast<kvm_coalesced_mmio_ring*>(page);
+}
+
+// Hand every queued coalesced write to fn, oldest first, and return how
+// many there were.  Only one thread may drain the ring at a time.
+unsigned vcpu::drain_coalesced_mmio(
+    std::function<void (const kvm_coalesced_mmio&)> fn)
+{
+    kvm_coalesced_mmio_ring *ring = coalesced_mmio_ring();
+    unsigned max = (::getpagesize() - sizeof(*ring))
+	/ sizeof(kvm_coalesced_mmio);
+    unsigned n = 0;
+
+    while (ring->first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+	fn(ring->coalesced_mmio[ring->first]);
+	__atomic_store_n(&ring->first, (ring->first + 1) % max,
+			 __ATOMIC_RELEASE);
+	++n;
+    }
+    return n;
+}
+
+msr_batch::msr_batch(unsigned capacity)
+    : _size(0), _capacity(capacity)
+{
+    for (unsigned n = 0; n < capacity; n += max_per_ioctl) {
+	size_t size = sizeof(kvm_msrs) + sizeof(kvm_msr_entry) * max_per_ioctl;
+	kvm_msrs* chunk = static_cast<kvm_msrs*>(::calloc(1, size));
+	if (!chunk) {
+	    std::for_each(_chunks.begin(), _chunks.end(), ::free);
+	    throw std::bad_alloc();
+	}
+	_chunks.push_back(chunk);
+    }
+}
+
+msr_batch::~msr_batch()
+{
+    std::for_each(_chunks.begin(), _chunks.end(), ::free);
+}
+
+void msr_batch::clear()
+{
+    for (auto chunk : _chunks) {
+	chunk->nmsrs = 0;
+    }
+    _size = 0;
+}
+
+void msr_batch::add(uint32_t index, uint64_t data)
+{
+    if (_size == _capacity) {
+	throw std::length_error("msr_batch full");
+    }
+    kvm_msrs* chunk = _chunks[_size / max_per_ioctl];
+    kvm_msr_entry& e = chunk->entries[chunk->nmsrs++];
+    e.index = index;
+    e.reserved = 0;
+    e.data = data;
+    ++_size;
+}
+
+// Returns the number of msrs KVM processed; like KVM, stop at the first
+// one it cannot handle.
+unsigned vcpu::msrs_ioctl(unsigned nr, const msr_batch& batch)
+{
+    unsigned done = 0;
+    for (auto chunk : batch._chunks) {
+	if (!chunk->nmsrs) {
+	    break;
+	}
+	unsigned n = _fd.ioctlp(nr, chunk);
+	done += n;
+	if (n < chunk->nmsrs) {
+	    break;
+	}
+    }
+    return done;
+}
+
+unsigned vcpu::get_msrs(msr_batch& batch)
+{
+    return msrs_ioctl(KVM_GET_MSRS, batch);
+}
+
+unsigned vcpu::set_msrs(const msr_batch& batch)
+{
+    return msrs_ioctl(KVM_SET_MSRS, batch);
+}
+
 void vcpu::set_debug(uint64_t dr[8], bool enabled, bool singlestep)
 {
     kvm_guest_debug gd;
@@ -145,9 +492,30 @@ void vcpu::set_debug(uint64_t dr[8], bool enabled, bool singlestep)
     _fd.ioctlp(KVM_SET_GUEST_DEBUG, &gd);
 }
 
+unsigned vcpu::dirty_ring_entries()
+{
+    return _vm._dirty_ring_size / sizeof(kvm_dirty_gfn);
+}
+
 vm::vm(system& system)
     : _system(system), _fd(system._fd.ioctl(KVM_CREATE_VM, 0))
+    , _dirty_ring_size(0), _manual_dirty_log_protect(false)
+    , _irqchip(false)
+{
+}
+
+void vm::enable_cap(uint32_t cap, uint64_t arg0)
+{
+    kvm_enable_cap ec = { };
+    ec.cap = cap;
+    ec.args[0] = arg0;
+    _fd.ioctlp(KVM_ENABLE_CAP, &ec);
+}
+
+// Like vcpu::stats_fd(), for the VM-wide statistics.
+int vm::stats_fd()
 {
+    return _fd.ioctl(KVM_GET_STATS_FD, 0);
 }
 
 void vm::set_memory_region(int slot, void *addr, uint64_t gpa, size_t len,
@@ -163,6 +531,24 @@ void vm::set_memory_region(int slot, void *addr, uint64_t gpa, size_t len,
     _fd.ioctlp(KVM_SET_USER_MEMORY_REGION, &umr);
 }
 
+void vm::register_coalesced_mmio(uint64_t addr, uint32_t size, bool pio)
+{
+    struct kvm_coalesced_mmio_zone zone = { };
+    zone.addr = addr;
+    zone.size = size;
+    zone.pio = pio;
+    _fd.ioctlp(KVM_REGISTER_COALESCED_MMIO, &zone);
+}
+
+void vm::unregister_coalesced_mmio(uint64_t addr, uint32_t size, bool pio)
+{
+    struct kvm_coalesced_mmio_zone zone = { };
+    zone.addr = addr;
+    zone.size = size;
+    zone.pio = pio;
+    _fd.ioctlp(KVM_UNREGISTER_COALESCED_MMIO, &zone);
+}
+
 void vm::get_dirty_log(int slot, void *log)
 {
     struct kvm_dirty_log kdl;
@@ -171,6 +557,162 @@ void vm::get_dirty_log(int slot, void *log)
     _fd.ioctlp(KVM_GET_DIRTY_LOG, &kdl);
 }
 
+// With manual protection, get_dirty_log() no longer write-protects the
+// pages it reports; they stay writable until passed to clear_dirty_log().
+void vm::enable_manual_dirty_log_protect()
+{
+    enable_cap(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2,
+               KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+    _manual_dirty_log_protect = true;
+}
+
+// log points at the bit for first_page; first_page and num_pages must be
+// multiples of 64, except that the range may end at the end of the slot.
+void vm::clear_dirty_log(int slot, void *log, uint64_t first_page,
+                         uint32_t num_pages)
+{
+    struct kvm_clear_dirty_log kcdl;
+    kcdl.slot = slot;
+    kcdl.num_pages = num_pages;
+    kcdl.first_page = first_page;
+    kcdl.dirty_bitmap = log;
+    _fd.ioctlp(KVM_CLEAR_DIRTY_LOG, &kcdl);
+}
+
+// Must be called before any vcpu is created; size is the per-vcpu ring
+// size in bytes.
+void vm::enable_dirty_log_ring(uint32_t size)
+{
+    enable_cap(KVM_CAP_DIRTY_LOG_RING, size);
+    _dirty_ring_size = size;
+}
+
+unsigned vm::reset_dirty_rings()
+{
+    return _fd.ioctl(KVM_RESET_DIRTY_RINGS, 0);
+}
+
+// Must be called before any vcpu is created.
+void vm::create_irqchip()
+{
+    _fd.ioctl(KVM_CREATE_IRQCHIP, 0);
+    _irqchip = true;
+}
+
+// Local APICs in the kernel, PIC and IOAPIC left to userspace.  Must
+// come before the first vcpu is created.
+void vm::create_split_irqchip(uint32_t nr_ioapic_pins)
+{
+    enable_cap(KVM_CAP_SPLIT_IRQCHIP, nr_ioapic_pins);
+    _irqchip = true;
+}
+
+kvm_irqchip vm::irqchip_state(uint32_t chip_id)
+{
+    kvm_irqchip chip = { };
+    chip.chip_id = chip_id;
+    _fd.ioctlp(KVM_GET_IRQCHIP, &chip);
+    return chip;
+}
+
+void vm::set_irqchip_state(const kvm_irqchip& chip)
+{
+    _fd.ioctlp(KVM_SET_IRQCHIP, const_cast<kvm_irqchip*>(&chip));
+}
+
+// Set the level of a GSI; edge-triggered inputs need a 0 -> 1 change
+// per interrupt.
+void vm::irq_line(uint32_t irq, bool level)
+{
+    kvm_irq_level line = { };
+    line.irq = irq;
+    line.level = level;
+    _fd.ioctlp(KVM_IRQ_LINE, &line);
+}
+
+// Replaces the whole routing table, including the default irqchip routes.
+void vm::set_gsi_routing(const std::vector<kvm_irq_routing_entry>& entries)
+{
+    std::vector<char> buf(sizeof(kvm_irq_routing)
+                          + entries.size() * sizeof(kvm_irq_routing_entry));
+    kvm_irq_routing *routing = reinterpret_cast<kvm_irq_routing*>(&buf[0]);
+    routing->nr = entries.size();
+    routing->flags = 0;
+    std::copy(entries.begin(), entries.end(), routing->entries);
+    _fd.ioctlp(KVM_SET_GSI_ROUTING, routing);
+}
+
+kvm_irq_routing_entry vm::msi_route(uint32_t gsi, uint64_t addr,
+                                    uint32_t data)
+{
+    kvm_irq_routing_entry e = { };
+    e.gsi = gsi;
+    e.type = KVM_IRQ_ROUTING_MSI;
+    e.u.msi.address_lo = addr;
+    e.u.msi.address_hi = addr >> 32;
+    e.u.msi.data = data;
+    return e;
+}
+
+void vm::signal_msi(uint64_t addr, uint32_t data)
+{
+    kvm_msi msi = { };
+    msi.address_lo = addr;
+    msi.address_hi = addr >> 32;
+    msi.data = data;
+    _fd.ioctlp(KVM_SIGNAL_MSI, &msi);
+}
+
+void vm::irqfd(int fd, uint32_t gsi, uint32_t flags)
+{
+    kvm_irqfd irqfd = { };
+    irqfd.fd = fd;
+    irqfd.gsi = gsi;
+    irqfd.flags = flags;
+    _fd.ioctlp(KVM_IRQFD, &irqfd);
+}
+
+void vm::add_irqfd(int fd, uint32_t gsi)
+{
+    irqfd(fd, gsi, 0);
+}
+
+void vm::remove_irqfd(int fd, uint32_t gsi)
+{
+    irqfd(fd, gsi, KVM_IRQFD_FLAG_DEASSIGN);
+}
+
+void vm::ioeventfd(int fd, uint64_t addr, uint32_t len, uint32_t flags,
+                   uint64_t data)
+{
+    kvm_ioeventfd ioeventfd = { };
+    ioeventfd.datamatch = data;
+    ioeventfd.addr = addr;
+    ioeventfd.len = len;
+    ioeventfd.fd = fd;
+    ioeventfd.flags = flags;
+    _fd.ioctlp(KVM_IOEVENTFD, &ioeventfd);
+}
+
+// A guest write of len bytes to addr (an I/O port if pio is set) signals
+// fd instead of exiting to userspace; with datamatch only writes of data.
+void vm::add_ioeventfd(int fd, uint64_t addr, uint32_t len, bool pio,
+                       bool datamatch, uint64_t data)
+{
+    ioeventfd(fd, addr, len,
+              (pio ? KVM_IOEVENTFD_FLAG_PIO : 0)
+              | (datamatch ? KVM_IOEVENTFD_FLAG_DATAMATCH : 0), data);
+}
+
+void vm::remove_ioeventfd(int fd, uint64_t addr, uint32_t len, bool pio,
+                          bool datamatch, uint64_t data)
+{
+    ioeventfd(fd, addr, len,
+              KVM_IOEVENTFD_FLAG_DEASSIGN
+              | (pio ? KVM_IOEVENTFD_FLAG_PIO : 0)
+              | (datamatch ? KVM_IOEVENTFD_FLAG_DATAMATCH : 0), data);
+}
+
 void vm::set_tss_addr(uint32_t addr)
 {
     _fd.ioctl(KVM_SET_TSS_ADDR, addr);
@@ -196,4 +738,34 @@ int system::get_extension_int(int extension)
     return _fd.ioctl(KVM_CHECK_EXTENSION, extension);
 }
 
+std::vector<uint32_t> system::msr_index_list()
+{
+    // a zero-sized list fails with E2BIG but reports the needed size
+    kvm_msr_list probe = { 0 };
+    ::ioctl(_fd.get(), KVM_GET_MSR_INDEX_LIST, &probe);
+    std::vector<uint32_t> buf(1 + probe.nmsrs);
+    kvm_msr_list* list = reinterpret_cast<kvm_msr_list*>(&buf[0]);
+    list->nmsrs = probe.nmsrs;
+    _fd.ioctlp(KVM_GET_MSR_INDEX_LIST, list);
+    return std::vector<uint32_t>(list->indices, list->indices + list->nmsrs);
+}
+
+std::vector<kvm_cpuid_entry2> system::supported_cpuid()
+{
+    // KVM fails with E2BIG without saying how many entries it needs
+    for (unsigned nent = 64; ; nent *= 2) {
+        std::vector<char> buf(sizeof(kvm_cpuid2)
+                              + nent * sizeof(kvm_cpuid_entry2));
+        kvm_cpuid2 *cpuid = reinterpret_cast<kvm_cpuid2*>(&buf[0]);
+        cpuid->nent = nent;
+        if (::ioctl(_fd.get(), KVM_GET_SUPPORTED_CPUID, cpuid) == 0) {
+            return std::vector<kvm_cpuid_entry2>(cpuid->entries,
+                                                 cpuid->entries + cpuid->nent);
+        }
+        if (errno != E2BIG) {
+            throw errno_exception(errno);
+        }
+    }
+}
+
 };
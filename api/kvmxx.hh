@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <linux/kvm.h>
 #include <stdint.h>
+#include <functional>
 
 namespace kvm {
 
@@ -15,6 +16,7 @@ class system;
 class vm;
 class vcpu;
 class fd;
+class msr_batch;
 
 class fd {
 public:
@@ -23,34 +25,106 @@ public:
     fd(const fd& other);
     ~fd() { ::close(_fd); }
     int get() { return _fd; }
+    unsigned long nr_ioctls() const { return _nr_ioctls; }
     long ioctl(unsigned nr, long arg);
     long ioctlp(unsigned nr, void *arg) {
 	return ioctl(nr, reinterpret_cast<long>(arg));
     }
 private:
     int _fd;
+    unsigned long _nr_ioctls;
+};
+
+// Preallocated kvm_msrs buffers that can be filled and passed to
+// vcpu::get_msrs()/set_msrs() repeatedly without touching the heap.
+// KVM takes at most max_per_ioctl msrs per call, so larger batches are
+// kept in several chunks and issued as several ioctls.
+class msr_batch {
+public:
+    static const unsigned max_per_ioctl = 255;
+    explicit msr_batch(unsigned capacity);
+    ~msr_batch();
+    void clear();
+    void add(uint32_t index, uint64_t data = 0);
+    unsigned size() const { return _size; }
+    unsigned capacity() const { return _capacity; }
+    kvm_msr_entry& operator[](unsigned i) {
+	return _chunks[i / max_per_ioctl]->entries[i % max_per_ioctl];
+    }
+    const kvm_msr_entry& operator[](unsigned i) const {
+	return _chunks[i / max_per_ioctl]->entries[i % max_per_ioctl];
+    }
+private:
+    msr_batch(const msr_batch&) = delete;
+    msr_batch& operator=(const msr_batch&) = delete;
+private:
+    std::vector<kvm_msrs*> _chunks;
+    unsigned _size;
+    unsigned _capacity;
+    friend class vcpu;
 };
 
 class vcpu {
 public:
     vcpu(vm& vm, int fd);
     ~vcpu();
+    system& sys();
     void run();
+    bool run_interruptible();
+    void interrupt(uint32_t vector);
     kvm_run *shared();
     kvm_regs regs();
     void set_regs(const kvm_regs& regs);
     kvm_sregs sregs();
     void set_sregs(const kvm_sregs& sregs);
-    std::vector<kvm_msr_entry> msrs(std::vector<uint32_t> indices);
+    kvm_vcpu_events vcpu_events();
+    void set_vcpu_events(const kvm_vcpu_events& events);
+    kvm_lapic_state lapic();
+    void set_lapic(const kvm_lapic_state& lapic);
+    bool irqchip() const;
+    kvm_mp_state mp_state();
+    void set_mp_state(const kvm_mp_state& state);
+    kvm_debugregs debugregs();
+    void set_debugregs(const kvm_debugregs& dregs);
+    kvm_fpu fpu();
+    void set_fpu(const kvm_fpu& fpu);
+    unsigned xsave_size();
+    void get_xsave(kvm_xsave* xsave);
+    void set_xsave(const kvm_xsave* xsave);
+#ifdef KVM_PRE_FAULT_MEMORY
+    void pre_fault_memory(uint64_t gpa, uint64_t size);
+#endif
+    std::vector<kvm_cpuid_entry2> cpuid();
+    void set_cpuid(const std::vector<kvm_cpuid_entry2>& entries);
+    kvm_xcrs xcrs();
+    void set_xcrs(const kvm_xcrs& xcrs);
+    int stats_fd();
+    void enable_sync_regs(uint64_t fields);
+    unsigned long nr_ioctls() const { return _fd.nr_ioctls(); }
+    std::vector<kvm_msr_entry> msrs(const std::vector<uint32_t>& indices);
     void set_msrs(const std::vector<kvm_msr_entry>& msrs);
+    unsigned get_msrs(msr_batch& batch);
+    unsigned set_msrs(const msr_batch& batch);
     void set_debug(uint64_t dr[8], bool enabled, bool singlestep);
+    kvm_dirty_gfn *dirty_ring() { return _dirty_ring; }
+    unsigned dirty_ring_entries();
+    kvm_coalesced_mmio_ring *coalesced_mmio_ring();
+    unsigned drain_coalesced_mmio(
+	std::function<void (const kvm_coalesced_mmio&)> fn);
 private:
     class kvm_msrs_ptr;
+    unsigned msrs_ioctl(unsigned nr, const msr_batch& batch);
 private:
     vm& _vm;
     fd _fd;
     kvm_run *_shared;
     unsigned _mmap_size;
+    kvm_dirty_gfn *_dirty_ring;
+    // KVM_SYNC_X86_* fields exchanged through _shared on KVM_RUN, and
+    // those whose copy in _shared is current
+    uint64_t _sync_regs;
+    uint64_t _sync_valid;
+    unsigned _xsave_size;
     friend class vm;
 };
 
@@ -59,13 +133,48 @@ public:
     explicit vm(system& system);
     void set_memory_region(int slot, void *addr, uint64_t gpa, size_t len,
                            uint32_t flags = 0);
+    void register_coalesced_mmio(uint64_t addr, uint32_t size,
+                                 bool pio = false);
+    void unregister_coalesced_mmio(uint64_t addr, uint32_t size,
+                                   bool pio = false);
     void get_dirty_log(int slot, void *log);
+    void create_irqchip();
+    void create_split_irqchip(uint32_t nr_ioapic_pins);
+    bool irqchip() const { return _irqchip; }
+    kvm_irqchip irqchip_state(uint32_t chip_id);
+    void set_irqchip_state(const kvm_irqchip& chip);
+    void irq_line(uint32_t irq, bool level);
+    void set_gsi_routing(const std::vector<kvm_irq_routing_entry>& entries);
+    static kvm_irq_routing_entry msi_route(uint32_t gsi, uint64_t addr,
+                                           uint32_t data);
+    void signal_msi(uint64_t addr, uint32_t data);
+    void add_irqfd(int fd, uint32_t gsi);
+    void remove_irqfd(int fd, uint32_t gsi);
+    void add_ioeventfd(int fd, uint64_t addr, uint32_t len, bool pio,
+                       bool datamatch = false, uint64_t data = 0);
+    void remove_ioeventfd(int fd, uint64_t addr, uint32_t len, bool pio,
+                          bool datamatch = false, uint64_t data = 0);
+    void enable_manual_dirty_log_protect();
+    bool manual_dirty_log_protect() const { return _manual_dirty_log_protect; }
+    void clear_dirty_log(int slot, void *log, uint64_t first_page,
+                         uint32_t num_pages);
+    void enable_dirty_log_ring(uint32_t size);
+    uint32_t dirty_log_ring_size() const { return _dirty_ring_size; }
+    unsigned reset_dirty_rings();
     void set_tss_addr(uint32_t addr);
     void set_ept_identity_map_addr(uint64_t addr);
+    void enable_cap(uint32_t cap, uint64_t arg0);
+    int stats_fd();
     system& sys() { return _system; }
 private:
+    void irqfd(int fd, uint32_t gsi, uint32_t flags);
+    void ioeventfd(int fd, uint64_t addr, uint32_t len, uint32_t flags,
+                   uint64_t data);
     system& _system;
     fd _fd;
+    uint32_t _dirty_ring_size;
+    bool _manual_dirty_log_protect;
+    bool _irqchip;
     friend class system;
     friend class vcpu;
 };
@@ -75,6 +184,8 @@ public:
     explicit system(std::string device_node = "/dev/kvm");
     bool check_extension(int extension);
     int get_extension_int(int extension);
+    std::vector<uint32_t> msr_index_list();
+    std::vector<kvm_cpuid_entry2> supported_cpuid();
 private:
     fd _fd;
     friend class vcpu;
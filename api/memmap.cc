@@ -1,24 +1,42 @@
 
 #include "memmap.hh"
 #include <numeric>
+#include <stdexcept>
+#include <immintrin.h>
 
 mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void* hva)
     : _map(map)
-    , _slot(map._free_slots.top())
+    , _slot(map.alloc_slot())
     , _gpa(gpa)
     , _size(size)
     , _hva(hva)
     , _dirty_log_enabled(false)
     , _log()
 {
-    map._free_slots.pop();
+    map._slots[_slot] = this;
     if (_size) {
         update();
     }
 }
 
+static void* guest_memory_hva(const guest_memory& mem, uint64_t offset,
+                              uint64_t size)
+{
+    if (offset > mem.size() || size > mem.size() - offset) {
+        throw std::out_of_range("mem_slot outside guest_memory");
+    }
+    return static_cast<char*>(mem.address()) + offset;
+}
+
+mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size,
+                   const guest_memory& mem, uint64_t offset)
+    : mem_slot(map, gpa, size, guest_memory_hva(mem, offset, size))
+{
+}
+
 mem_slot::~mem_slot()
 {
+    _map._slots[_slot] = NULL;
     if (!_size) {
         return;
     }
@@ -31,6 +49,16 @@ mem_slot::~mem_slot()
     }
 }
 
+// KVM moves the slot in place; its contents and dirty logging state
+// are kept.
+void mem_slot::move(uint64_t gpa)
+{
+    _gpa = gpa;
+    if (_size) {
+        update();
+    }
+}
+
 void mem_slot::set_dirty_logging(bool enabled)
 {
     if (_dirty_log_enabled != enabled) {
@@ -40,6 +68,8 @@ void mem_slot::set_dirty_logging(bool enabled)
             _log.resize(logsize);
         } else {
             _log.resize(0);
+            _ring_pending.clear();
+            _ring_reported.clear();
         }
         if (_size) {
             update();
@@ -61,6 +91,8 @@ bool mem_slot::dirty_logging() const
     return _dirty_log_enabled;
 }
 
+namespace dirty_bitmap {
+
 static inline int hweight(uint64_t w)
 {
     w -= (w >> 1) & 0x5555555555555555;
@@ -69,15 +101,178 @@ static inline int hweight(uint64_t w)
     return (w * 0x0101010101010101) >> 56;
 }
 
-int mem_slot::update_dirty_log()
+static uint64_t count_scalar(const ulong* log, size_t nwords)
 {
-    _map._vm.get_dirty_log(_slot, &_log[0]);
-    return std::accumulate(_log.begin(), _log.end(), 0,
-                           [] (int prev, ulong elem) -> int {
+    return std::accumulate(log, log + nwords, uint64_t(0),
+                           [] (uint64_t prev, ulong elem) -> uint64_t {
                                return prev + hweight(elem);
                            });
 }
 
+static size_t next_nonzero_scalar(const ulong* log, size_t from,
+                                  size_t nwords)
+{
+    while (from < nwords && !log[from]) {
+        ++from;
+    }
+    return from;
+}
+
+__attribute__((target("popcnt")))
+static uint64_t count_popcnt(const ulong* log, size_t nwords)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < nwords; ++i) {
+        n += __builtin_popcountl(log[i]);
+    }
+    return n;
+}
+
+static const size_t words_per_ymm = 32 / sizeof(ulong);
+
+// Nibble lookup popcount: count the bits of each byte with vpshufb and
+// sum the bytes into 64-bit lanes with vpsadbw.  All-zero blocks, the
+// common case for a sparse log, are skipped with a single vptest.
+__attribute__((target("avx2,popcnt")))
+static uint64_t count_avx2(const ulong* log, size_t nwords)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + words_per_ymm <= nwords; i += words_per_ymm) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(log + i));
+        if (_mm256_testz_si256(v, v)) {
+            continue;
+        }
+        __m256i lo = _mm256_and_si256(v, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                        _mm256_shuffle_epi8(lut, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes,
+                                                    _mm256_setzero_si256()));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    uint64_t n = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < nwords; ++i) {
+        n += __builtin_popcountl(log[i]);
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+static size_t next_nonzero_avx2(const ulong* log, size_t from, size_t nwords)
+{
+    while (from < nwords && from % words_per_ymm) {
+        if (log[from]) {
+            return from;
+        }
+        ++from;
+    }
+    for (; from + words_per_ymm <= nwords; from += words_per_ymm) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(log + from));
+        if (!_mm256_testz_si256(v, v)) {
+            break;
+        }
+    }
+    return next_nonzero_scalar(log, from, nwords);
+}
+
+static scan_impl resolve(scan_impl impl)
+{
+    static scan_impl best = scan_supported(scan_avx2) ? scan_avx2
+                          : scan_supported(scan_popcnt) ? scan_popcnt
+                          : scan_scalar;
+    return impl == scan_best ? best : impl;
+}
+
+bool scan_supported(scan_impl impl)
+{
+    switch (impl) {
+    case scan_popcnt:
+        return __builtin_cpu_supports("popcnt");
+    case scan_avx2:
+        return __builtin_cpu_supports("avx2")
+            && __builtin_cpu_supports("popcnt");
+    default:
+        return true;
+    }
+}
+
+const char* scan_name(scan_impl impl)
+{
+    static const char* names[] = { "scalar", "popcnt", "avx2" };
+    return names[resolve(impl)];
+}
+
+uint64_t count(const ulong* log, size_t nwords, scan_impl impl)
+{
+    switch (resolve(impl)) {
+    case scan_avx2:
+        return count_avx2(log, nwords);
+    case scan_popcnt:
+        return count_popcnt(log, nwords);
+    default:
+        return count_scalar(log, nwords);
+    }
+}
+
+size_t next_nonzero(const ulong* log, size_t from, size_t nwords,
+                    scan_impl impl)
+{
+    if (resolve(impl) == scan_avx2) {
+        return next_nonzero_avx2(log, from, nwords);
+    }
+    return next_nonzero_scalar(log, from, nwords);
+}
+
+}
+
+int mem_slot::update_dirty_log()
+{
+    if (_map.dirty_ring_enabled()) {
+        return update_dirty_log_ring();
+    }
+    _map._vm.get_dirty_log(_slot, &_log[0]);
+    return dirty_bitmap::count(_log.data(), _log.size());
+}
+
+// Write-protect again the pages in [first_page, first_page + npages) that
+// the last update_dirty_log() reported, so that further guest writes to
+// them are logged.  Only meaningful with manual dirty log protection.
+void mem_slot::clear_dirty_log(uint64_t first_page, uint64_t npages)
+{
+    _map._vm.clear_dirty_log(_slot, &_log[first_page / bits_per_word],
+                             first_page, npages);
+}
+
+// Only touches the pages reported by the rings, so the cost scales with
+// the number of dirty pages rather than with the slot size.
+int mem_slot::update_dirty_log_ring()
+{
+    for (auto pagenr : _ring_reported) {
+        _log[pagenr / bits_per_word] &= ~(1UL << (pagenr % bits_per_word));
+    }
+    _ring_reported.clear();
+    _map.harvest_dirty_rings();
+    for (auto pagenr : _ring_pending) {
+        ulong& word = _log[pagenr / bits_per_word];
+        ulong bit = 1UL << (pagenr % bits_per_word);
+        if (!(word & bit)) {
+            word |= bit;
+            _ring_reported.push_back(pagenr);
+        }
+    }
+    _ring_pending.clear();
+    return _ring_reported.size();
+}
+
 bool mem_slot::is_dirty(uint64_t gpa) const
 {
     uint64_t pagenr = (gpa - _gpa) >> 12;
@@ -93,4 +288,57 @@ mem_map::mem_map(kvm::vm& vm)
     for (int i = 0; i < nr_slots; ++i) {
         _free_slots.push(i);
     }
+    _slots.resize(nr_slots);
+}
+
+int mem_map::alloc_slot()
+{
+    if (_free_slots.empty()) {
+        throw std::length_error("no free memory slots");
+    }
+    int slot = _free_slots.top();
+    _free_slots.pop();
+    return slot;
+}
+
+bool mem_map::dirty_ring_enabled() const
+{
+    return _vm.dirty_log_ring_size() != 0;
+}
+
+void mem_map::add_dirty_ring(kvm::vcpu& vcpu)
+{
+    dirty_ring ring = { &vcpu, 0 };
+    _dirty_rings.push_back(ring);
+}
+
+// Collect the dirty gfns published by every registered vcpu ring into the
+// owning slots, then let KVM recycle the collected entries.  Returns the
+// number of entries harvested.
+unsigned mem_map::harvest_dirty_rings()
+{
+    unsigned harvested = 0;
+    for (auto& ring : _dirty_rings) {
+        kvm_dirty_gfn* gfns = ring.vcpu->dirty_ring();
+        uint32_t mask = ring.vcpu->dirty_ring_entries() - 1;
+        while (true) {
+            kvm_dirty_gfn* e = &gfns[ring.fetch & mask];
+            uint32_t flags = __atomic_load_n(&e->flags, __ATOMIC_ACQUIRE);
+            if (!(flags & KVM_DIRTY_GFN_F_DIRTY)) {
+                break;
+            }
+            mem_slot* slot = _slots[e->slot & 0xffff];
+            if (slot && slot->_dirty_log_enabled) {
+                slot->_ring_pending.push_back(e->offset);
+            }
+            __atomic_store_n(&e->flags, KVM_DIRTY_GFN_F_RESET,
+                             __ATOMIC_RELEASE);
+            ++ring.fetch;
+            ++harvested;
+        }
+    }
+    if (harvested) {
+        _vm.reset_dirty_rings();
+    }
+    return harvested;
 }
@@ -2,6 +2,7 @@
 #define MEMMAP_HH
 
 #include "kvmxx.hh"
+#include "guestmem.hh"
 #include <stdint.h>
 #include <vector>
 #include <stack>
@@ -9,16 +10,57 @@
 class mem_map;
 class mem_slot;
 
+// Dirty bitmap scanning.  scan_best picks the fastest implementation the
+// host CPU supports; the others are there so they can be compared.
+namespace dirty_bitmap {
+
+typedef unsigned long ulong;
+static const int bits_per_word = sizeof(ulong) * 8;
+
+enum scan_impl { scan_scalar, scan_popcnt, scan_avx2, scan_best };
+
+bool scan_supported(scan_impl impl);
+const char* scan_name(scan_impl impl);
+uint64_t count(const ulong* log, size_t nwords, scan_impl impl = scan_best);
+// Index of the first non-zero word at or after from, or nwords.
+size_t next_nonzero(const ulong* log, size_t from, size_t nwords,
+                    scan_impl impl = scan_best);
+
+// Call fn(pagenr) for every set bit, in ascending order.
+template <typename Fn>
+void for_each(const ulong* log, size_t nwords, Fn fn,
+              scan_impl impl = scan_best)
+{
+    for (size_t i = next_nonzero(log, 0, nwords, impl); i < nwords;
+         i = next_nonzero(log, i + 1, nwords, impl)) {
+        ulong w = log[i];
+        while (w) {
+            fn(uint64_t(i) * bits_per_word + __builtin_ctzl(w));
+            w &= w - 1;
+        }
+    }
+}
+
+}
+
 class mem_slot {
 public:
     mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void *hva);
+    // map size bytes of mem, starting offset bytes in, at gpa
+    mem_slot(mem_map& map, uint64_t gpa, uint64_t size,
+             const guest_memory& mem, uint64_t offset = 0);
     ~mem_slot();
+    void move(uint64_t gpa);
     void set_dirty_logging(bool enabled);
     bool dirty_logging() const;
     int update_dirty_log();
+    void clear_dirty_log(uint64_t first_page, uint64_t npages);
     bool is_dirty(uint64_t gpa) const;
+    template <typename Fn>
+    void for_each_dirty_page(Fn fn) const;
 private:
     void update();
+    int update_dirty_log_ring();
 private:
     typedef unsigned long ulong;
     static const int bits_per_word = sizeof(ulong) * 8;
@@ -29,14 +71,40 @@ private:
     void *_hva;
     bool _dirty_log_enabled;
     std::vector<ulong> _log;
+    // dirty ring mode: pages harvested but not yet reported, and pages
+    // set in _log by the previous update_dirty_log()
+    std::vector<uint64_t> _ring_pending;
+    std::vector<uint64_t> _ring_reported;
+    friend class mem_map;
 };
 
+// Call fn(gpa) for every page reported dirty by the last
+// update_dirty_log().
+template <typename Fn>
+void mem_slot::for_each_dirty_page(Fn fn) const
+{
+    uint64_t gpa = _gpa;
+    dirty_bitmap::for_each(_log.data(), _log.size(),
+                           [&] (uint64_t pagenr) { fn(gpa + (pagenr << 12)); });
+}
+
 class mem_map {
 public:
     mem_map(kvm::vm& vm);
+    bool dirty_ring_enabled() const;
+    void add_dirty_ring(kvm::vcpu& vcpu);
+    unsigned harvest_dirty_rings();
+    unsigned nr_free_slots() const { return _free_slots.size(); }
 private:
+    int alloc_slot();
+    struct dirty_ring {
+        kvm::vcpu* vcpu;
+        uint32_t fetch;
+    };
     kvm::vm& _vm;
     std::stack<int> _free_slots;
+    std::vector<mem_slot*> _slots;
+    std::vector<dirty_ring> _dirty_rings;
     friend class mem_slot;
 };
 
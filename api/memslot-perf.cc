@@ -0,0 +1,243 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "memmap.hh"
+#include "guestmem.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include "runloop.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+const int page_size = 4096;
+// slot moves and dirty logging toggles timed at each slot count
+const unsigned nr_reps = 100;
+int max_slots = 0;	// 0 = as many as KVM allows
+bool show_stats = false;
+std::vector<volatile char*> touch_order;
+
+// Guest: write to each page once, in the order the host picked.
+void touch_pages()
+{
+    for (auto p : touch_order) {
+        *p = 1;
+    }
+}
+
+// Per-operation cost with nr_slots slots registered.  Creation and
+// deletion are averaged over the slots added since (or removed down to)
+// the previous row.
+struct slot_sample {
+    int nr_slots;
+    uint64_t create_ns;
+    uint64_t move_ns;
+    uint64_t dirty_log_ns;
+    uint64_t delete_ns;
+};
+
+// Slot counts to stop at: powers of two, then nr_slots itself.
+std::vector<int> checkpoints(int nr_slots)
+{
+    std::vector<int> counts;
+    for (int n = 1; n < nr_slots; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(nr_slots);
+    return counts;
+}
+
+// Fill the VM with one-page slots, timing creation, moves and dirty
+// logging toggles of the newest slot as the count grows, then delete
+// them all again.  Slot i maps page i of mem at the matching GPA; the
+// page after the last slot is left free to move slots to.
+std::vector<slot_sample> run_slot_ops(kvm::system& sys)
+{
+    int max_memslots = sys.get_extension_int(KVM_CAP_NR_MEMSLOTS);
+    guest_memory mem(uint64_t(max_memslots + 1) * page_size,
+                     guest_memory::anon);
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap, identity::hole(mem));
+    uint64_t base_gpa = identity::gpa(mem.address());
+
+    int nr_slots = memmap.nr_free_slots();
+    if (max_slots && max_slots < nr_slots) {
+        nr_slots = max_slots;
+    }
+    printf("memslot-perf: %d of %d slots available to the benchmark\n",
+           nr_slots, max_memslots);
+
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+    }
+    std::vector<slot_sample> samples;
+    std::vector<std::unique_ptr<mem_slot> > slots;
+    for (int count : checkpoints(nr_slots)) {
+        slot_sample s = { count, 0, 0, 0, 0 };
+        int prev = slots.size();
+
+        uint64_t start_ns = time_ns();
+        while (int(slots.size()) < count) {
+            uint64_t offset = uint64_t(slots.size()) * page_size;
+            slots.push_back(std::unique_ptr<mem_slot>(
+                new mem_slot(memmap, base_gpa + offset, page_size, mem,
+                             offset)));
+        }
+        s.create_ns = (time_ns() - start_ns) / (count - prev);
+
+        mem_slot& slot = *slots.back();
+        uint64_t gpa = base_gpa + uint64_t(count - 1) * page_size;
+        uint64_t spare_gpa = base_gpa + uint64_t(max_memslots) * page_size;
+        start_ns = time_ns();
+        for (unsigned i = 0; i < nr_reps; ++i) {
+            slot.move(spare_gpa);
+            slot.move(gpa);
+        }
+        s.move_ns = (time_ns() - start_ns) / (2 * nr_reps);
+
+        start_ns = time_ns();
+        for (unsigned i = 0; i < nr_reps; ++i) {
+            slot.set_dirty_logging(true);
+            slot.set_dirty_logging(false);
+        }
+        s.dirty_log_ns = (time_ns() - start_ns) / (2 * nr_reps);
+        samples.push_back(s);
+    }
+
+    for (auto s = samples.rbegin(); s != samples.rend(); ++s) {
+        auto next = s + 1;
+        int down_to = next == samples.rend() ? 0 : next->nr_slots;
+        uint64_t start_ns = time_ns();
+        while (int(slots.size()) > down_to) {
+            slots.pop_back();
+        }
+        s->delete_ns = (time_ns() - start_ns) / (s->nr_slots - down_to);
+    }
+    if (show_stats) {
+        printf("kvm stats:\n");
+        stats.print(stdout);
+    }
+    return samples;
+}
+
+// Time the guest's first and second write to each of nr_pages pages, in
+// random order, with the pages mapped by a single slot or by one slot
+// each.  The host pages are populated beforehand, so the first write
+// costs a fault that looks up the slot and maps the page and the second
+// one shows what the loop costs without faults.
+void run_touch(kvm::system& sys, int nr_pages, bool slot_per_page)
+{
+    guest_memory mem(uint64_t(nr_pages) * page_size, guest_memory::anon);
+    memset(mem.address(), 0, mem.size());
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap, identity::hole(mem));
+    kvm::vcpu vcpu(vm, 0);
+    uint64_t base_gpa = identity::gpa(mem.address());
+
+    std::vector<std::unique_ptr<mem_slot> > slots;
+    if (slot_per_page) {
+        for (int i = 0; i < nr_pages; ++i) {
+            uint64_t offset = uint64_t(i) * page_size;
+            slots.push_back(std::unique_ptr<mem_slot>(
+                new mem_slot(memmap, base_gpa + offset, page_size, mem,
+                             offset)));
+        }
+    } else {
+        slots.push_back(std::unique_ptr<mem_slot>(
+            new mem_slot(memmap, base_gpa, mem.size(), mem)));
+    }
+
+    char* head = static_cast<char*>(mem.address());
+    touch_order.clear();
+    for (int i = 0; i < nr_pages; ++i) {
+        touch_order.push_back(head + uint64_t(i) * page_size);
+    }
+    std::shuffle(touch_order.begin(), touch_order.end(), std::mt19937(1));
+
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        stats.add(vcpu);
+    }
+    uint64_t ns[2];
+    for (int pass = 0; pass < 2; ++pass) {
+        identity::vcpu guest(vcpu, touch_pages);
+        uint64_t start_ns = time_ns();
+        vcpu.run();
+        ns[pass] = time_ns() - start_ns;
+    }
+    printf("%6d %-6s %12.0f %12.0f\n", int(slots.size()),
+           slot_per_page ? "slots" : "slot",
+           double(ns[0]) / nr_pages, double(ns[1]) / nr_pages);
+    if (show_stats) {
+        stats.print(stdout);
+    }
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "n:S")) != -1) {
+        switch (opt) {
+        case 'n':
+            errno = 0;
+            max_slots = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || max_slots <= 0) {
+                printf("memslot-perf: Invalid number: -n %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("memslot-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+    if (show_stats && !stats_supported(sys, "memslot-perf")) {
+        return 1;
+    }
+
+    std::vector<slot_sample> samples = run_slot_ops(sys);
+    printf("%6s %12s %12s %12s %12s\n", "slots",
+           "create ns", "move ns", "dirty-log ns", "delete ns");
+    for (auto& s : samples) {
+        printf("%6d %12lld %12lld %12lld %12lld\n", s.nr_slots,
+               (long long)s.create_ns, (long long)s.move_ns,
+               (long long)s.dirty_log_ns, (long long)s.delete_ns);
+    }
+
+    int nr_pages = samples.back().nr_slots;
+    printf("\nguest writes to %d pages, ns per page\n", nr_pages);
+    printf("%13s %12s %12s\n", "mapped by", "first", "second");
+    run_touch(sys, nr_pages, false);
+    run_touch(sys, nr_pages, true);
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
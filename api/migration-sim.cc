@@ -0,0 +1,281 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "stats.hh"
+#include "runloop.hh"
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace {
+
+const int page_size	= 4096;
+int64_t nr_pages	= 256 * 1024;
+int64_t dirty_rate	= 20000;	// pages per second written by the guest
+int64_t bandwidth	= 1024;		// MiB per second, 0 = unlimited
+double downtime_target	= 30;		// milliseconds
+int max_rounds		= 30;
+bool show_stats		= false;
+
+// Guest: dirty pseudo-random pages of the slot, never getting ahead of
+// the write budget handed out by the host pacer.
+void dirty_mem(volatile bool& running, volatile char* head,
+               volatile uint64_t& allowed, volatile uint64_t& written)
+{
+    uint32_t seed = 12345;
+
+    while (running) {
+        if (written >= allowed) {
+            asm volatile("pause");
+            continue;
+        }
+        seed = seed * 1103515245 + 12345;
+        ++head[(seed % nr_pages) * page_size];
+        ++written;
+    }
+}
+
+// Host: grow the guest's write budget at dirty_rate pages per second.
+void pace_guest(volatile bool& running, volatile uint64_t& allowed)
+{
+    uint64_t start_ns = time_ns();
+
+    while (running) {
+        allowed = (time_ns() - start_ns) * dirty_rate / 1000000000;
+        usleep(100);
+    }
+}
+
+class page_copier {
+public:
+    page_copier(char* src, char* dst);
+    void start_round();
+    void copy(int64_t pagenr);
+    uint64_t round_ns() const { return time_ns() - _round_start_ns; }
+private:
+    char* _src;
+    char* _dst;
+    uint64_t _round_start_ns;
+    uint64_t _round_bytes;
+};
+
+page_copier::page_copier(char* src, char* dst)
+    : _src(src), _dst(dst), _round_start_ns(), _round_bytes()
+{
+}
+
+void page_copier::start_round()
+{
+    _round_start_ns = time_ns();
+    _round_bytes = 0;
+}
+
+// Copy one page, sleeping as needed to stay below the bandwidth cap.
+void page_copier::copy(int64_t pagenr)
+{
+    memcpy(_dst + pagenr * page_size, _src + pagenr * page_size, page_size);
+    _round_bytes += page_size;
+    if (!bandwidth) {
+        return;
+    }
+    uint64_t due_ns = _round_bytes * 1000000000 / (bandwidth << 20);
+    uint64_t elapsed_ns = time_ns() - _round_start_ns;
+    if (elapsed_ns + 50000 < due_ns) {
+        usleep((due_ns - elapsed_ns) / 1000);
+    }
+}
+
+// Expected time to send npages at the bandwidth cap, in milliseconds.
+double transfer_ms(int64_t npages, double measured_mib_s)
+{
+    double mib = double(npages) * page_size / (1 << 20);
+    double rate = bandwidth ? bandwidth : measured_mib_s;
+    return rate ? mib / rate * 1000 : 0;
+}
+
+int64_t copy_dirty_pages(mem_slot& slot, page_copier& copier, uint64_t gpa)
+{
+    int64_t copied = 0;
+
+    slot.for_each_dirty_page([&] (uint64_t page_gpa) {
+        copier.copy((page_gpa - gpa) / page_size);
+        ++copied;
+    });
+    return copied;
+}
+
+}
+
+// Exit unless the number just parsed took up all of -opt's argument.
+void check_number(int opt, const char* endptr)
+{
+    if (errno || endptr == optarg || *endptr) {
+        printf("migration-sim: Invalid number: -%c %s\n", opt, optarg);
+        exit(1);
+    }
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "n:d:b:t:r:S")) != -1) {
+        errno = 0;
+        switch (opt) {
+        case 'n':
+            nr_pages = strtol(optarg, &endptr, 10);
+            if (*endptr == 'k' || *endptr == 'K') {
+                nr_pages *= 1024;
+                ++endptr;
+            }
+            check_number(opt, endptr);
+            break;
+        case 'd':
+            dirty_rate = strtol(optarg, &endptr, 10);
+            check_number(opt, endptr);
+            break;
+        case 'b':
+            bandwidth = strtol(optarg, &endptr, 10);
+            check_number(opt, endptr);
+            break;
+        case 't':
+            downtime_target = strtod(optarg, &endptr);
+            check_number(opt, endptr);
+            break;
+        case 'r':
+            max_rounds = strtol(optarg, &endptr, 10);
+            check_number(opt, endptr);
+            break;
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("migration-sim: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (nr_pages <= 0) {
+        printf("migration-sim: Invalid setting: %lld pages\n",
+               (long long)nr_pages);
+        exit(1);
+    }
+    printf("migration-sim: %lld pages, dirty rate %lld pages/s, "
+           "bandwidth %lld MiB/s, downtime target %.1f ms\n",
+           (long long)nr_pages, (long long)dirty_rate, (long long)bandwidth,
+           downtime_target);
+}
+
+int test_main(int ac, char **av)
+{
+    parse_options(ac, av);
+
+    kvm::system sys;
+    if (show_stats && !stats_supported(sys, "migration-sim")) {
+        exit(1);
+    }
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+
+    void* mem_head;
+    int64_t mem_size = nr_pages * page_size;
+    if (posix_memalign(&mem_head, page_size, mem_size)) {
+        printf("migration-sim: Could not allocate guest memory.\n");
+        exit(1);
+    }
+    std::vector<char> dest(mem_size);
+    memset(mem_head, 0, mem_size);
+
+    identity::hole hole(mem_head, mem_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+    uint64_t gpa = identity::gpa(mem_head);
+    mem_slot slot(memmap, gpa, mem_size, mem_head);
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        stats.add(vcpu);
+    }
+
+    volatile bool running = true;
+    volatile uint64_t allowed = 0, written = 0;
+    std::thread pacer(pace_guest, std::ref(running), std::ref(allowed));
+    std::thread guest([&] {
+        identity::vcpu guest_thread(vcpu, std::bind(dirty_mem,
+                                                    std::ref(running),
+                                                    static_cast<char*>(mem_head),
+                                                    std::ref(allowed),
+                                                    std::ref(written)));
+        vcpu.run();
+    });
+
+    page_copier copier(static_cast<char*>(mem_head), &dest[0]);
+    uint64_t start_ns = time_ns();
+    int64_t total_sent = 0;
+    double mib_s = 0, est_ms = 0;
+
+    // round 0 sends everything, later rounds what was dirtied meanwhile
+    slot.set_dirty_logging(true);
+    slot.update_dirty_log();
+    copier.start_round();
+    for (int64_t i = 0; i < nr_pages; ++i) {
+        copier.copy(i);
+    }
+    int64_t sent = nr_pages;
+    for (int round = 0; ; ++round) {
+        uint64_t ns = copier.round_ns();
+        mib_s = double(sent) * page_size / (1 << 20) / (ns / 1e9);
+        total_sent += sent;
+
+        int64_t dirty = slot.update_dirty_log();
+        est_ms = transfer_ms(dirty, mib_s);
+        printf("round %3d: %10lld pages sent in %10.2f ms, %8.1f MiB/s, "
+               "%10lld dirtied, est. downtime %8.2f ms\n",
+               round, (long long)sent, ns / 1e6, mib_s, (long long)dirty, est_ms);
+        if (est_ms <= downtime_target || round + 1 >= max_rounds) {
+            break;
+        }
+        copier.start_round();
+        sent = copy_dirty_pages(slot, copier, gpa);
+    }
+
+    // stop and copy: the pages dirtied before the last harvest, then
+    // whatever the guest wrote until it was stopped
+    uint64_t stop_ns = time_ns();
+    running = false;
+    guest.join();
+    pacer.join();
+    copier.start_round();
+    int64_t dirty = copy_dirty_pages(slot, copier, gpa);
+    slot.update_dirty_log();
+    dirty += copy_dirty_pages(slot, copier, gpa);
+    uint64_t end_ns = time_ns();
+    total_sent += dirty;
+    slot.set_dirty_logging(false);
+
+    printf("stop-and-copy: %lld pages, downtime %.2f ms (estimated %.2f ms)\n",
+           (long long)dirty, (end_ns - stop_ns) / 1e6, est_ms);
+    printf("total: %.2f ms, %lld pages sent (%.2fx guest memory), "
+           "guest wrote %lld pages\n",
+           (end_ns - start_ns) / 1e6, (long long)total_sent,
+           double(total_sent) / nr_pages, (long long)written);
+    if (show_stats) {
+        printf("kvm stats:\n");
+        stats.print(stdout);
+    }
+
+    if (memcmp(mem_head, &dest[0], mem_size)) {
+        printf("migration-sim: destination does not match source\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
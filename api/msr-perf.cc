@@ -0,0 +1,132 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "runloop.hh"
+#include "stats.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+const unsigned max_batch = 512;
+const unsigned msrs_per_size = 1 << 20;
+bool show_stats = false;
+
+// MSRs from KVM's index list that can be read and written back unchanged
+// on a fresh vcpu.
+std::vector<uint32_t> usable_msrs(kvm::system& sys, kvm::vcpu& vcpu)
+{
+    std::vector<uint32_t> usable;
+    kvm::msr_batch one(1);
+
+    for (auto index : sys.msr_index_list()) {
+        one.clear();
+        one.add(index);
+        if (vcpu.get_msrs(one) == 1 && vcpu.set_msrs(one) == 1) {
+            usable.push_back(index);
+        }
+    }
+    return usable;
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+
+    while ((opt = getopt(ac, av, "S")) != -1) {
+        switch (opt) {
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("msr-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    parse_options(ac, av);
+
+    kvm::system sys;
+    if (show_stats && !stats_supported(sys, "msr-perf")) {
+        return 1;
+    }
+    kvm::vm vm(sys);
+    kvm::vcpu vcpu(vm, 0);
+
+    std::vector<uint32_t> indices = usable_msrs(sys, vcpu);
+    if (indices.empty()) {
+        printf("msr-perf: no usable MSRs\n");
+        return 1;
+    }
+    printf("msr-perf: %u usable MSRs\n", (unsigned)indices.size());
+    printf("%6s %12s %12s %12s %12s\n", "batch",
+           "get ns/msr", "set ns/msr", "vec get", "vec set");
+
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        stats.add(vcpu);
+    }
+    kvm::msr_batch batch(max_batch);
+    for (unsigned size = 1; size <= max_batch; size *= 2) {
+        if (show_stats) {
+            stats.start();
+        }
+        std::vector<uint32_t> vec_indices;
+        batch.clear();
+        for (unsigned i = 0; i < size; ++i) {
+            batch.add(indices[i % indices.size()]);
+            vec_indices.push_back(indices[i % indices.size()]);
+        }
+        unsigned iterations = msrs_per_size / size;
+
+        uint64_t t1 = time_ns();
+        for (unsigned i = 0; i < iterations; ++i) {
+            vcpu.get_msrs(batch);
+        }
+        uint64_t t2 = time_ns();
+        for (unsigned i = 0; i < iterations; ++i) {
+            vcpu.set_msrs(batch);
+        }
+        uint64_t t3 = time_ns();
+
+        double n = double(iterations) * size;
+        printf("%6u %12.1f %12.1f", size, (t2 - t1) / n, (t3 - t2) / n);
+
+        // the same through the std::vector based interface, which is
+        // limited to what a single ioctl takes
+        if (size > kvm::msr_batch::max_per_ioctl) {
+            printf(" %12s %12s\n", "-", "-");
+            if (show_stats) {
+                stats.print(stdout);
+            }
+            continue;
+        }
+        std::vector<kvm_msr_entry> entries;
+        uint64_t t4 = time_ns();
+        for (unsigned i = 0; i < iterations; ++i) {
+            entries = vcpu.msrs(vec_indices);
+        }
+        uint64_t t5 = time_ns();
+        for (unsigned i = 0; i < iterations; ++i) {
+            vcpu.set_msrs(entries);
+        }
+        uint64_t t6 = time_ns();
+        printf(" %12.1f %12.1f\n", (t5 - t4) / n, (t6 - t5) / n);
+        if (show_stats) {
+            stats.print(stdout);
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -0,0 +1,397 @@
+#include "kvmxx.hh"
+#include "exception.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "guestmem.hh"
+#include "runloop.hh"
+#include "stats.hh"
+#include <linux/userfaultfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <x86intrin.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+const int page_size	= 4096;
+int64_t mem_mib		= 256;
+int nr_vcpus		= 1;
+int nr_handlers		= 1;
+int fetch_delay_us	= 0;	// simulated network time per page
+int hot_pct		= 10;	// hot set size, in percent of memory
+const int hot_hit_pct	= 90;	// accesses that go to the hot set
+bool show_stats		= false;
+
+enum pattern {
+    sequential,		// every page once, in order
+    random_pages,	// uniformly random pages, as many accesses as pages
+    hot_set,		// most accesses to a small set of pages
+    nr_patterns,
+};
+
+const char* pattern_names[nr_patterns] = { "sequential", "random", "hot-set" };
+std::vector<pattern> patterns;
+
+// The destination side of post-copy: guest memory registered with
+// userfaultfd, whose missing pages a pool of handler threads copies in
+// from the source buffer as the guest faults on them.
+class postcopy_dest {
+public:
+    postcopy_dest(guest_memory& mem, const char* source);
+    ~postcopy_dest();
+    void start(int nr_threads);
+    void stop();
+    uint64_t nr_faults() const { return _nr_faults; }
+    const latency_histogram& service() const { return _service; }
+private:
+    void serve(latency_histogram* service);
+private:
+    guest_memory& _mem;
+    const char* _source;
+    int _uffd;
+    int _stop_fd;
+    std::atomic<uint64_t> _nr_faults;
+    std::vector<std::thread> _threads;
+    std::vector<latency_histogram> _per_thread;
+    latency_histogram _service;
+};
+
+postcopy_dest::postcopy_dest(guest_memory& mem, const char* source)
+    : _mem(mem), _source(source), _nr_faults(0)
+{
+    _uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (_uffd == -1) {
+        throw errno_exception(errno);
+    }
+    uffdio_api api = { UFFD_API };
+    uffdio_register reg = { };
+    reg.range.start = reinterpret_cast<uintptr_t>(mem.address());
+    reg.range.len = mem.size();
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    _stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (_stop_fd == -1 || ioctl(_uffd, UFFDIO_API, &api) == -1
+        || ioctl(_uffd, UFFDIO_REGISTER, &reg) == -1) {
+        int err = errno;
+        close(_uffd);
+        if (_stop_fd != -1) {
+            close(_stop_fd);
+        }
+        throw errno_exception(err);
+    }
+}
+
+postcopy_dest::~postcopy_dest()
+{
+    stop();
+    close(_uffd);
+    close(_stop_fd);
+}
+
+void postcopy_dest::start(int nr_threads)
+{
+    _per_thread.resize(nr_threads);
+    for (auto& h : _per_thread) {
+        _threads.push_back(std::thread(&postcopy_dest::serve, this, &h));
+    }
+}
+
+void postcopy_dest::stop()
+{
+    if (_threads.empty()) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(_stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        throw errno_exception(errno);
+    }
+    for (auto& t : _threads) {
+        t.join();
+    }
+    _threads.clear();
+    for (auto& h : _per_thread) {
+        _service.merge(h);
+    }
+}
+
+// Handler thread: take a fault, "fetch" the page and copy it in, which
+// wakes the vcpu.  Service times run from reading the fault message to
+// the end of UFFDIO_COPY.
+void postcopy_dest::serve(latency_histogram* service)
+{
+    pollfd fds[2] = { { _uffd, POLLIN, 0 }, { _stop_fd, POLLIN, 0 } };
+    char* dest = static_cast<char*>(_mem.address());
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw errno_exception(errno);
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        uffd_msg msg;
+        if (read(_uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            // another handler got there first
+            if (errno == EAGAIN) {
+                continue;
+            }
+            throw errno_exception(errno);
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        uint64_t start_ns = time_ns();
+        if (fetch_delay_us) {
+            usleep(fetch_delay_us);
+        }
+        uint64_t addr = msg.arg.pagefault.address & ~uint64_t(page_size - 1);
+        uffdio_copy copy = { };
+        copy.dst = addr;
+        copy.src = reinterpret_cast<uintptr_t>(_source)
+            + (addr - reinterpret_cast<uintptr_t>(dest));
+        copy.len = page_size;
+        // EEXIST: the page was copied in for an earlier message already
+        if (ioctl(_uffd, UFFDIO_COPY, &copy) == -1 && errno != EEXIST) {
+            throw errno_exception(errno);
+        }
+        service->add(time_ns() - start_ns);
+        ++_nr_faults;
+    }
+}
+
+// One vcpu's accesses: the pages to write, in order, and the TSC cycles
+// each write took.
+struct vcpu_ctx {
+    kvm::vcpu* vcpu;
+    std::vector<volatile char*> order;
+    std::vector<bool> first_touch;
+    std::vector<uint64_t> cycles;
+};
+
+void guest_access(vcpu_ctx* ctx)
+{
+    for (size_t i = 0; i < ctx->order.size(); ++i) {
+        uint64_t start = __rdtsc();
+        *ctx->order[i] = 1;
+        ctx->cycles[i] = __rdtsc() - start;
+    }
+}
+
+void vcpu_thread(vcpu_ctx* ctx)
+{
+    identity::vcpu guest(*ctx->vcpu, std::bind(guest_access, ctx));
+    ctx->vcpu->run();
+}
+
+// Fill ctx's access list for pattern p over nr_pages pages at head.
+void make_order(vcpu_ctx* ctx, pattern p, char* head, uint64_t nr_pages,
+                std::mt19937& rng)
+{
+    std::uniform_int_distribution<uint64_t> any(0, nr_pages - 1);
+    uint64_t nr_hot = std::max<uint64_t>(1, nr_pages * hot_pct / 100);
+    std::uniform_int_distribution<uint64_t> hot(0, nr_hot - 1);
+    std::uniform_int_distribution<int> pct(0, 99);
+    std::vector<uint64_t> pages(nr_pages);
+
+    for (uint64_t i = 0; i < nr_pages; ++i) {
+        switch (p) {
+        case sequential:
+            pages[i] = i;
+            break;
+        case random_pages:
+            pages[i] = any(rng);
+            break;
+        default:
+            pages[i] = pct(rng) < hot_hit_pct ? hot(rng) : any(rng);
+            break;
+        }
+    }
+    std::vector<bool> seen(nr_pages);
+    for (auto page : pages) {
+        ctx->order.push_back(head + page * page_size);
+        ctx->first_touch.push_back(!seen[page]);
+        seen[page] = true;
+    }
+    ctx->cycles.assign(nr_pages, 0);
+}
+
+// Run pattern p on a VM whose memory starts out missing, the state
+// right after the switch-over to the destination.
+void run(kvm::system& sys, const char* source, pattern p, double scale)
+{
+    guest_memory mem(mem_mib << 20, guest_memory::anon);
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap, identity::hole(mem));
+    mem_slot slot(memmap, identity::gpa(mem.address()), mem.size(), mem);
+
+    uint64_t nr_pages = mem.size() / page_size / nr_vcpus;
+    std::mt19937 rng(1);
+    std::vector<std::unique_ptr<kvm::vcpu> > vcpus;
+    std::vector<vcpu_ctx> ctxs(nr_vcpus);
+    for (int i = 0; i < nr_vcpus; ++i) {
+        vcpus.push_back(std::unique_ptr<kvm::vcpu>(new kvm::vcpu(vm, i)));
+        ctxs[i].vcpu = vcpus.back().get();
+        char* head = static_cast<char*>(mem.address())
+            + i * nr_pages * page_size;
+        make_order(&ctxs[i], p, head, nr_pages, rng);
+    }
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        for (auto& v : vcpus) {
+            stats.add(*v);
+        }
+    }
+
+    postcopy_dest dest(mem, source);
+    dest.start(nr_handlers);
+    std::vector<std::thread> threads;
+    uint64_t start_ns = time_ns();
+    for (auto& ctx : ctxs) {
+        threads.push_back(std::thread(vcpu_thread, &ctx));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    uint64_t run_ns = time_ns() - start_ns;
+    dest.stop();
+
+    // the guest's view: first touches wait for the page, summed over
+    // all vcpus that is the stall time
+    latency_histogram fault;
+    std::vector<uint64_t> fault_ns;
+    uint64_t stall_ns = 0;
+    for (auto& ctx : ctxs) {
+        for (size_t i = 0; i < ctx.order.size(); ++i) {
+            if (ctx.first_touch[i]) {
+                uint64_t ns = ctx.cycles[i] / scale;
+                fault.add(ns);
+                fault_ns.push_back(ns);
+                stall_ns += ns;
+            }
+        }
+    }
+    printf("%-10s %8llu %10.1f %10.1f %10.0f %10llu %10llu %10llu %10llu\n",
+           pattern_names[p], (unsigned long long)dest.nr_faults(),
+           run_ns / 1e6, stall_ns / 1e6, fault.mean(),
+           (unsigned long long)percentile(fault_ns, 50),
+           (unsigned long long)percentile(fault_ns, 99),
+           (unsigned long long)fault.max(),
+           (unsigned long long)dest.service().percentile(99));
+    if (show_stats) {
+        stats.print(stdout);
+    }
+}
+
+}
+
+long parse_number(int opt, const char* arg, long min, long max)
+{
+    char *endptr;
+
+    errno = 0;
+    long val = strtol(arg, &endptr, 10);
+    if (errno || endptr == arg || *endptr || val < min || val > max) {
+        printf("postcopy-sim: Invalid number: -%c %s\n", opt, arg);
+        exit(1);
+    }
+    return val;
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt, p;
+
+    while ((opt = getopt(ac, av, "m:v:t:d:h:p:S")) != -1) {
+        switch (opt) {
+        case 'm':
+            mem_mib = parse_number(opt, optarg, 1, 1 << 20);
+            break;
+        case 'v':
+            nr_vcpus = parse_number(opt, optarg, 1, 1024);
+            break;
+        case 't':
+            nr_handlers = parse_number(opt, optarg, 1, 1024);
+            break;
+        case 'd':
+            fetch_delay_us = parse_number(opt, optarg, 0, 1000000);
+            break;
+        case 'h':
+            hot_pct = parse_number(opt, optarg, 1, 100);
+            break;
+        case 'p':
+            for (p = 0; p < nr_patterns; ++p) {
+                if (strcmp(optarg, pattern_names[p]) == 0) {
+                    break;
+                }
+            }
+            if (p == nr_patterns) {
+                printf("postcopy-sim: Invalid pattern: -p %s\n", optarg);
+                exit(1);
+            }
+            patterns.push_back(pattern(p));
+            break;
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("postcopy-sim: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (patterns.empty()) {
+        for (p = 0; p < nr_patterns; ++p) {
+            patterns.push_back(pattern(p));
+        }
+    }
+}
+
+int test_main(int ac, char** av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+    if (show_stats && !stats_supported(sys, "postcopy-sim")) {
+        return 1;
+    }
+
+    // what the source host still has; the contents do not matter
+    std::vector<char> source(mem_mib << 20);
+    for (size_t i = 0; i < source.size(); i += page_size) {
+        source[i] = i / page_size;
+    }
+    double scale = tsc_per_ns();
+
+    printf("postcopy-sim: %lld MiB, %d vcpus, %d handler threads, "
+           "%d us fetch delay, hot set %d%%\n", (long long)mem_mib,
+           nr_vcpus, nr_handlers, fetch_delay_us, hot_pct);
+    printf("%-10s %8s %10s %10s %10s %10s %10s %10s %10s\n", "pattern",
+           "faults", "run ms", "stall ms", "fault ns", "p50 ns", "p99 ns",
+           "max ns", "serve p99<=");
+    for (auto p : patterns) {
+        run(sys, &source[0], p, scale);
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
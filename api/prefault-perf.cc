@@ -0,0 +1,289 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "memmap.hh"
+#include "guestmem.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include "runloop.hh"
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace {
+
+const int page_size = 4096;
+int64_t mem_mib = 1024;
+int max_vcpus = 0;	// 0 = the number of CPUs
+bool show_stats = false;
+std::vector<guest_memory::backing> backings;
+
+// What happens before the guest first touches its memory.
+enum prep {
+    prep_none,		// nothing, each first touch faults in host and TDP
+    prep_populate,	// MADV_POPULATE_WRITE, the guest only builds TDP
+    prep_pre_fault,	// KVM_PRE_FAULT_MEMORY, both are done up front
+    nr_preps,
+};
+
+const char* prep_names[nr_preps] = { "none", "populate", "pre-fault" };
+
+// Guest: write one byte to every 4 KiB page of the region.
+void touch_pages(volatile char* head, uint64_t size)
+{
+    for (uint64_t off = 0; off < size; off += page_size) {
+        head[off] = 1;
+    }
+}
+
+struct vcpu_ctx {
+    kvm::vcpu* vcpu;
+    char* head;
+    uint64_t size;
+    uint64_t prep_ns;
+    uint64_t touch_ns;
+    std::exception_ptr error;
+};
+
+std::atomic<int> nr_prepared;
+
+void prepare(vcpu_ctx* ctx, prep how)
+{
+    switch (how) {
+    case prep_populate:
+        if (madvise(ctx->head, ctx->size, MADV_POPULATE_WRITE) == -1) {
+            throw errno_exception(errno);
+        }
+        break;
+#ifdef KVM_PRE_FAULT_MEMORY
+    case prep_pre_fault:
+        ctx->vcpu->pre_fault_memory(identity::gpa(ctx->head), ctx->size);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+// Each vcpu prepares its own region, then all of them start touching
+// at the same time.  A failure (e.g. too few huge pages to populate)
+// is left in ctx->error for run() to rethrow once every thread is done.
+void vcpu_thread(vcpu_ctx* ctx, prep how, int nr_vcpus)
+{
+    bool arrived = false;
+    auto arrive = [&] {
+        arrived = true;
+        ++nr_prepared;
+        while (nr_prepared < nr_vcpus) {
+            std::this_thread::yield();
+        }
+    };
+
+    try {
+        identity::vcpu guest(*ctx->vcpu, std::bind(touch_pages, ctx->head,
+                                                   ctx->size));
+        uint64_t start_ns = time_ns();
+        prepare(ctx, how);
+        ctx->prep_ns = time_ns() - start_ns;
+
+        arrive();
+        start_ns = time_ns();
+        ctx->vcpu->run();
+        ctx->touch_ns = time_ns() - start_ns;
+    } catch (...) {
+        ctx->error = std::current_exception();
+        // don't leave the other vcpus waiting
+        if (!arrived) {
+            arrive();
+        }
+    }
+}
+
+// Populate a fresh VM's memory with nr_vcpus vcpus, each on a disjoint
+// slice of one big slot.  Times are those of the slowest vcpu.
+void run(kvm::system& sys, guest_memory::backing b, prep how, int nr_vcpus)
+{
+    guest_memory mem(mem_mib << 20, b);
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap, identity::hole(mem));
+    mem_slot slot(memmap, identity::gpa(mem.address()), mem.size(), mem);
+
+    uint64_t slice = mem.size() / nr_vcpus & ~uint64_t(page_size - 1);
+    std::vector<std::unique_ptr<kvm::vcpu> > vcpus;
+    std::vector<vcpu_ctx> ctxs(nr_vcpus);
+    for (int i = 0; i < nr_vcpus; ++i) {
+        vcpus.push_back(std::unique_ptr<kvm::vcpu>(new kvm::vcpu(vm, i)));
+        ctxs[i].vcpu = vcpus.back().get();
+        ctxs[i].head = static_cast<char*>(mem.address()) + i * slice;
+        ctxs[i].size = slice;
+    }
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        for (auto& v : vcpus) {
+            stats.add(*v);
+        }
+    }
+
+    nr_prepared = 0;
+    std::vector<std::thread> threads;
+    for (auto& ctx : ctxs) {
+        threads.push_back(std::thread(vcpu_thread, &ctx, how, nr_vcpus));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (auto& ctx : ctxs) {
+        if (ctx.error) {
+            std::rethrow_exception(ctx.error);
+        }
+    }
+
+    uint64_t prep_ns = 0, touch_ns = 0;
+    for (auto& ctx : ctxs) {
+        prep_ns = std::max(prep_ns, ctx.prep_ns);
+        touch_ns = std::max(touch_ns, ctx.touch_ns);
+    }
+    double gib = double(slice) * nr_vcpus / (1 << 30);
+    printf("%-10s %6d %12.1f %12.1f %12.2f %12.2f\n", prep_names[how],
+           nr_vcpus, prep_ns / 1e6, touch_ns / 1e6,
+           gib * 1e9 / touch_ns, gib * 1e9 / (prep_ns + touch_ns));
+    if (show_stats) {
+        stats.print(stdout);
+    }
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "m:v:b:S")) != -1) {
+        switch (opt) {
+        case 'm':
+            errno = 0;
+            mem_mib = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || mem_mib <= 0) {
+                printf("prefault-perf: Invalid number: -m %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'v':
+            errno = 0;
+            max_vcpus = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || max_vcpus <= 0) {
+                printf("prefault-perf: Invalid number: -v %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "all") == 0) {
+                for (int b = 0; b < guest_memory::nr_backings; ++b) {
+                    backings.push_back(guest_memory::backing(b));
+                }
+            } else {
+                guest_memory::backing b;
+                if (!guest_memory::parse(optarg, b)) {
+                    printf("prefault-perf: Invalid backing: -b %s\n", optarg);
+                    exit(1);
+                }
+                backings.push_back(b);
+            }
+            break;
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("prefault-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (backings.empty()) {
+        backings.push_back(guest_memory::anon);
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+    if (show_stats && !stats_supported(sys, "prefault-perf")) {
+        return 1;
+    }
+    if (!max_vcpus) {
+        max_vcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    int kvm_max = sys.get_extension_int(KVM_CAP_MAX_VCPUS);
+    if (max_vcpus > kvm_max) {
+        printf("prefault-perf: KVM supports only %d vcpus\n", kvm_max);
+        max_vcpus = kvm_max;
+    }
+
+    // KVM_PRE_FAULT_MEMORY needs TDP, i.e. EPT or NPT
+    bool have_pre_fault = false;
+#ifdef KVM_PRE_FAULT_MEMORY
+    have_pre_fault = sys.check_extension(KVM_CAP_PRE_FAULT_MEMORY);
+#endif
+    printf("prefault-perf: %lld MiB, one write per 4 KiB page\n",
+           (long long)mem_mib);
+
+    for (auto b : backings) {
+        bool have_populate;
+        try {
+            guest_memory probe(page_size, b);
+            have_populate = madvise(probe.address(), page_size,
+                                    MADV_POPULATE_WRITE) == 0;
+        } catch (errno_exception& e) {
+            printf("\nbacking %s: not available, skipped\n",
+                   guest_memory::name(b));
+            continue;
+        }
+        printf("\nbacking %s: %zu KiB pages\n", guest_memory::name(b),
+               guest_memory::page_size(b) / 1024);
+        printf("%-10s %6s %12s %12s %12s %12s\n", "prep", "vcpus",
+               "prep ms", "touch ms", "touch GiB/s", "total GiB/s");
+        for (int p = 0; p < nr_preps; ++p) {
+            if ((p == prep_populate && !have_populate)
+                || (p == prep_pre_fault && !have_pre_fault)) {
+                printf("%-10s not supported\n", prep_names[p]);
+                continue;
+            }
+            for (int n = 1; ; n = std::min(n * 2, max_vcpus)) {
+                try {
+                    run(sys, b, prep(p), n);
+                } catch (errno_exception& e) {
+                    // e.g. too few huge pages for the whole size
+                    printf("%-10s %6d failed: %s\n", prep_names[p], n,
+                           e.what());
+                    break;
+                }
+                if (n == max_vcpus) {
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
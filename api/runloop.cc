@@ -0,0 +1,245 @@
+#include "runloop.hh"
+#include <x86intrin.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+double tsc_per_ns()
+{
+    uint64_t t1 = time_ns(), c1 = __rdtsc();
+    usleep(100000);
+    uint64_t t2 = time_ns(), c2 = __rdtsc();
+    return double(c2 - c1) / (t2 - t1);
+}
+
+latency_histogram::latency_histogram()
+{
+    reset();
+}
+
+void latency_histogram::reset()
+{
+    for (int i = 0; i < nr_buckets; ++i) {
+        _buckets[i] = 0;
+    }
+    _count = _total = _max = 0;
+    _min = ~0ULL;
+}
+
+// bucket i holds [2^(i-1), 2^i), bucket 0 holds zero
+void latency_histogram::add(uint64_t ns)
+{
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    ++_buckets[bucket < nr_buckets ? bucket : nr_buckets - 1];
+    ++_count;
+    _total += ns;
+    if (ns < _min) {
+        _min = ns;
+    }
+    if (ns > _max) {
+        _max = ns;
+    }
+}
+
+void latency_histogram::merge(const latency_histogram& other)
+{
+    for (int i = 0; i < nr_buckets; ++i) {
+        _buckets[i] += other._buckets[i];
+    }
+    _count += other._count;
+    _total += other._total;
+    if (other._min < _min) {
+        _min = other._min;
+    }
+    if (other._max > _max) {
+        _max = other._max;
+    }
+}
+
+uint64_t latency_histogram::percentile(double p) const
+{
+    uint64_t want = _count * p / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < nr_buckets; ++i) {
+        seen += _buckets[i];
+        if (seen >= want && seen) {
+            uint64_t upper = i ? (1ULL << i) - 1 : 0;
+            return upper < _max ? upper : _max;
+        }
+    }
+    return _max;
+}
+
+uint64_t percentile(std::vector<uint64_t>& samples, double p)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    // nearest rank
+    size_t rank = samples.size() * p / 100;
+    if (rank * 100 < samples.size() * p) {
+        ++rank;
+    }
+    return samples[rank ? rank - 1 : 0];
+}
+
+void latency_histogram::print(FILE* out, const char* indent) const
+{
+    for (int i = 0; i < nr_buckets; ++i) {
+        if (!_buckets[i]) {
+            continue;
+        }
+        fprintf(out, "%s%12llu - %12llu ns: %12llu\n", indent,
+                i ? 1ULL << (i - 1) : 0ULL, i ? (1ULL << i) - 1 : 0ULL,
+                (unsigned long long)_buckets[i]);
+    }
+}
+
+run_loop::run_loop(kvm::vcpu& vcpu)
+    : _vcpu(vcpu)
+{
+}
+
+void run_loop::on_exit(uint32_t exit_reason, handler h)
+{
+    if (exit_reason >= nr_reasons) {
+        throw std::out_of_range("exit reason");
+    }
+    _handlers[exit_reason] = h;
+}
+
+void run_loop::on_pio(uint16_t port, handler h)
+{
+    _pio[port] = h;
+}
+
+void run_loop::on_mmio(uint64_t gpa, uint64_t len, handler h)
+{
+    mmio_range r = { len, h };
+    _mmio[gpa] = r;
+}
+
+void run_loop::on_hlt(handler h)
+{
+    on_exit(KVM_EXIT_HLT, h);
+}
+
+const run_loop::handler* run_loop::find_pio() const
+{
+    auto i = _pio.find(_vcpu.shared()->io.port);
+    return i != _pio.end() ? &i->second : NULL;
+}
+
+const run_loop::handler* run_loop::find_mmio() const
+{
+    uint64_t gpa = _vcpu.shared()->mmio.phys_addr;
+    auto i = _mmio.upper_bound(gpa);
+    if (i == _mmio.begin()) {
+        return NULL;
+    }
+    --i;
+    return gpa - i->first < i->second.len ? &i->second.h : NULL;
+}
+
+// Port and address specific handlers take precedence over a handler for
+// the whole exit reason.
+bool run_loop::dispatch()
+{
+    uint32_t reason = _vcpu.shared()->exit_reason;
+    const handler* h = NULL;
+    if (reason == KVM_EXIT_IO) {
+        h = find_pio();
+    } else if (reason == KVM_EXIT_MMIO) {
+        h = find_mmio();
+    }
+    if (!h && reason < nr_reasons && _handlers[reason]) {
+        h = &_handlers[reason];
+    }
+    return h && (*h)(_vcpu);
+}
+
+uint32_t run_loop::run()
+{
+    uint64_t entry_ns = time_ns();
+    while (true) {
+        _vcpu.run();
+        uint64_t exit_ns = time_ns();
+        uint32_t reason = _vcpu.shared()->exit_reason;
+        unsigned idx = reason < nr_reasons ? reason : nr_reasons - 1;
+        _run_stats[idx].add(exit_ns - entry_ns);
+        if (!dispatch()) {
+            return reason;
+        }
+        entry_ns = time_ns();
+        _stats[idx].add(entry_ns - exit_ns);
+    }
+}
+
+const latency_histogram& run_loop::stats(uint32_t exit_reason) const
+{
+    return _stats[exit_reason < nr_reasons ? exit_reason : nr_reasons - 1];
+}
+
+const latency_histogram& run_loop::run_stats(uint32_t exit_reason) const
+{
+    return _run_stats[exit_reason < nr_reasons ? exit_reason
+                                               : nr_reasons - 1];
+}
+
+void run_loop::reset_stats()
+{
+    for (unsigned i = 0; i < nr_reasons; ++i) {
+        _stats[i].reset();
+        _run_stats[i].reset();
+    }
+}
+
+void run_loop::print_stats(FILE* out) const
+{
+    for (unsigned i = 0; i < nr_reasons; ++i) {
+        const latency_histogram& h = _stats[i];
+        const latency_histogram& r = _run_stats[i];
+        if (!h.count()) {
+            continue;
+        }
+        fprintf(out, "%-16s %10llu runs,  ns min %llu mean %.1f "
+                "p50 <=%llu p99 <=%llu max %llu (in KVM_RUN)\n", exit_name(i),
+                (unsigned long long)r.count(), (unsigned long long)r.min(),
+                r.mean(), (unsigned long long)r.percentile(50),
+                (unsigned long long)r.percentile(99),
+                (unsigned long long)r.max());
+        fprintf(out, "%-16s %10llu exits, ns min %llu mean %.1f "
+                "p50 <=%llu p99 <=%llu max %llu (in userspace)\n", exit_name(i),
+                (unsigned long long)h.count(), (unsigned long long)h.min(),
+                h.mean(), (unsigned long long)h.percentile(50),
+                (unsigned long long)h.percentile(99),
+                (unsigned long long)h.max());
+        h.print(out, "    ");
+    }
+}
+
+const char* run_loop::exit_name(uint32_t exit_reason)
+{
+    static const char* names[] = {
+        "unknown", "exception", "io", "hypercall", "debug", "hlt", "mmio",
+        "irq_window_open", "shutdown", "fail_entry", "intr", "set_tpr",
+        "tpr_access", 0, 0, 0, "nmi", "internal_error", 0, 0, 0, 0, 0, 0,
+        "system_event", 0, "ioapic_eoi", "hyperv", 0, "x86_rdmsr",
+        "x86_wrmsr", "dirty_ring_full", 0, "x86_bus_lock",
+    };
+    if (exit_reason < sizeof(names) / sizeof(names[0])
+        && names[exit_reason]) {
+        return names[exit_reason];
+    }
+    return "other";
+}
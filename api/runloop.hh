@@ -0,0 +1,81 @@
+#ifndef API_RUNLOOP_HH
+#define API_RUNLOOP_HH
+
+#include "kvmxx.hh"
+#include <functional>
+#include <map>
+#include <vector>
+#include <stdio.h>
+
+// Return the current time in nanoseconds.
+uint64_t time_ns();
+// Host TSC cycles per nanosecond, measured over 100 ms.
+double tsc_per_ns();
+
+// log2 latency histogram, in nanoseconds
+class latency_histogram {
+public:
+    static const int nr_buckets = 64;
+    latency_histogram();
+    void add(uint64_t ns);
+    void merge(const latency_histogram& other);
+    void reset();
+    uint64_t count() const { return _count; }
+    uint64_t total() const { return _total; }
+    uint64_t min() const { return _min; }
+    uint64_t max() const { return _max; }
+    double mean() const { return _count ? double(_total) / _count : 0; }
+    // upper bound of the bucket holding the p-th percentile (0 < p <= 100),
+    // i.e. 2^k - 1 for some k; use the free percentile() for exact values
+    uint64_t percentile(double p) const;
+    void print(FILE* out, const char* indent = "") const;
+private:
+    uint64_t _buckets[nr_buckets];
+    uint64_t _count;
+    uint64_t _total;
+    uint64_t _min;
+    uint64_t _max;
+};
+
+// Exact p-th percentile (0 < p <= 100) of raw samples, which get sorted.
+uint64_t percentile(std::vector<uint64_t>& samples, double p);
+
+// Runs a vcpu, dispatching each exit to a handler and timing how long
+// userspace takes from the return of KVM_RUN to the next entry, as well
+// as how long each KVM_RUN took (kernel and guest time).
+// A handler returns true to resume the guest and false to stop the loop;
+// run() also stops on an exit nobody handles.
+class run_loop {
+public:
+    typedef std::function<bool (kvm::vcpu& vcpu)> handler;
+    explicit run_loop(kvm::vcpu& vcpu);
+    void on_exit(uint32_t exit_reason, handler h);
+    void on_pio(uint16_t port, handler h);
+    void on_mmio(uint64_t gpa, uint64_t len, handler h);
+    void on_hlt(handler h);
+    // returns the exit reason that stopped the loop
+    uint32_t run();
+    const latency_histogram& stats(uint32_t exit_reason) const;
+    const latency_histogram& run_stats(uint32_t exit_reason) const;
+    void reset_stats();
+    void print_stats(FILE* out) const;
+    static const char* exit_name(uint32_t exit_reason);
+private:
+    static const unsigned nr_reasons = 64;
+    bool dispatch();
+    const handler* find_pio() const;
+    const handler* find_mmio() const;
+private:
+    struct mmio_range {
+        uint64_t len;
+        handler h;
+    };
+    kvm::vcpu& _vcpu;
+    handler _handlers[nr_reasons];
+    std::map<uint16_t, handler> _pio;
+    std::map<uint64_t, mmio_range> _mmio;
+    latency_histogram _stats[nr_reasons];
+    latency_histogram _run_stats[nr_reasons];
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "stats.hh"
+#include "exception.hh"
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+bool stats_supported(kvm::system& sys, const char* prog)
+{
+    if (!sys.check_extension(KVM_CAP_BINARY_STATS_FD)) {
+        printf("%s: KVM_CAP_BINARY_STATS_FD not supported\n", prog);
+        return false;
+    }
+    return true;
+}
+
+stats_reader::stats_reader(kvm::vm& vm)
+    : _fd(vm.stats_fd())
+{
+    read_descriptors();
+}
+
+stats_reader::stats_reader(kvm::vcpu& vcpu)
+    : _fd(vcpu.stats_fd())
+{
+    read_descriptors();
+}
+
+void stats_reader::pread_all(void* buf, size_t size, off_t offset)
+{
+    ssize_t r = ::pread(_fd.get(), buf, size, offset);
+    if (r == -1) {
+        throw errno_exception(errno);
+    }
+    if (size_t(r) != size) {
+        throw std::runtime_error("short read from KVM stats fd");
+    }
+}
+
+// The file starts with a header giving the offsets of the id string,
+// of the descriptors (each followed by a name_size byte name) and of
+// the data, an array of u64 that each descriptor indexes by byte offset.
+void stats_reader::read_descriptors()
+{
+    kvm_stats_header header;
+    pread_all(&header, sizeof(header), 0);
+
+    std::vector<char> id(header.name_size + 1);
+    pread_all(id.data(), header.name_size, header.id_offset);
+    _id = id.data();
+
+    size_t desc_size = sizeof(kvm_stats_desc) + header.name_size;
+    std::vector<char> descs(desc_size * header.num_desc + 1);
+    pread_all(descs.data(), desc_size * header.num_desc, header.desc_offset);
+
+    uint32_t data_size = 0;
+    for (uint32_t i = 0; i < header.num_desc; ++i) {
+        const kvm_stats_desc* d
+            = reinterpret_cast<const kvm_stats_desc*>(&descs[i * desc_size]);
+        descriptor desc;
+        desc.name.assign(d->name, strnlen(d->name, header.name_size));
+        desc.flags = d->flags;
+        desc.exponent = d->exponent;
+        desc.size = d->size;
+        desc.offset = d->offset;
+        desc.bucket_size = d->bucket_size;
+        _descs.push_back(desc);
+        data_size = std::max(data_size,
+                             uint32_t(d->offset + d->size * sizeof(uint64_t)));
+    }
+    _data_offset = header.data_offset;
+    _data.resize(data_size / sizeof(uint64_t));
+}
+
+std::vector<uint64_t> stats_reader::read()
+{
+    pread_all(_data.data(), _data.size() * sizeof(uint64_t), _data_offset);
+    std::vector<uint64_t> values;
+    for (auto& d : _descs) {
+        const uint64_t* v = &_data[d.offset / sizeof(uint64_t)];
+        values.insert(values.end(), v, v + d.size);
+    }
+    return values;
+}
+
+// Counters and histograms only grow, so a difference between two reads
+// is meaningful; instant values and peaks are not.
+bool stats_reader::cumulative(const descriptor& d)
+{
+    switch (d.flags & KVM_STATS_TYPE_MASK) {
+    case KVM_STATS_TYPE_CUMULATIVE:
+    case KVM_STATS_TYPE_LINEAR_HIST:
+    case KVM_STATS_TYPE_LOG_HIST:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool stats_reader::histogram(const descriptor& d)
+{
+    switch (d.flags & KVM_STATS_TYPE_MASK) {
+    case KVM_STATS_TYPE_LINEAR_HIST:
+    case KVM_STATS_TYPE_LOG_HIST:
+        return true;
+    default:
+        return false;
+    }
+}
+
+namespace {
+
+// The range of values that bucket i of histogram d counts; the last
+// bucket also counts everything above it.
+std::string bucket_range(const stats_reader::descriptor& d, unsigned i)
+{
+    unsigned long long lo, hi;
+    char buf[64];
+
+    if ((d.flags & KVM_STATS_TYPE_MASK) == KVM_STATS_TYPE_LOG_HIST) {
+        // bucket 0 holds 0, bucket i > 0 holds [2^(i-1), 2^i)
+        lo = i ? 1ULL << (i - 1) : 0;
+        hi = i ? (1ULL << i) - 1 : 0;
+    } else {
+        lo = (unsigned long long)i * d.bucket_size;
+        hi = lo + d.bucket_size - 1;
+    }
+    if (i == d.size - 1u) {
+        snprintf(buf, sizeof(buf), "%llu+", lo);
+    } else if (lo == hi) {
+        snprintf(buf, sizeof(buf), "%llu", lo);
+    } else {
+        snprintf(buf, sizeof(buf), "%llu-%llu", lo, hi);
+    }
+    return buf;
+}
+
+}
+
+void stats_delta::add(kvm::vm& vm)
+{
+    source s = { std::make_shared<stats_reader>(vm) };
+    s.before = s.reader->read();
+    _sources.push_back(s);
+}
+
+void stats_delta::add(kvm::vcpu& vcpu)
+{
+    source s = { std::make_shared<stats_reader>(vcpu) };
+    s.before = s.reader->read();
+    _sources.push_back(s);
+}
+
+void stats_delta::start()
+{
+    for (auto& s : _sources) {
+        s.before = s.reader->read();
+        s.after.clear();
+    }
+}
+
+void stats_delta::stop()
+{
+    for (auto& s : _sources) {
+        s.after = s.reader->read();
+    }
+}
+
+void stats_delta::print(FILE* out, const char* indent)
+{
+    // per statistic, in the order first seen: its descriptor and the
+    // change of each of its values
+    std::vector<std::pair<stats_reader::descriptor, std::vector<uint64_t> > >
+        deltas;
+    std::map<std::string, size_t> index;
+
+    for (auto& s : _sources) {
+        std::vector<uint64_t> now = s.after.empty() ? s.reader->read()
+                                                    : s.after;
+        size_t pos = 0;
+        for (auto& d : s.reader->descriptors()) {
+            size_t first = pos;
+            pos += d.size;
+            if (!stats_reader::cumulative(d)) {
+                continue;
+            }
+            auto it = index.find(d.name);
+            if (it == index.end()) {
+                it = index.insert(std::make_pair(d.name, deltas.size())).first;
+                deltas.push_back(std::make_pair(d,
+                                                std::vector<uint64_t>(d.size)));
+            }
+            std::vector<uint64_t>& delta = deltas[it->second].second;
+            for (unsigned i = 0; i < d.size && i < delta.size(); ++i) {
+                delta[i] += now[first + i] - s.before[first + i];
+            }
+        }
+    }
+    for (auto& d : deltas) {
+        const stats_reader::descriptor& desc = d.first;
+        uint64_t total = 0;
+        for (auto v : d.second) {
+            total += v;
+        }
+        if (!total) {
+            continue;
+        }
+        fprintf(out, "%s%-32s %14llu\n", indent, desc.name.c_str(),
+                (unsigned long long)total);
+        if (!stats_reader::histogram(desc)) {
+            continue;
+        }
+        for (unsigned i = 0; i < d.second.size(); ++i) {
+            if (d.second[i]) {
+                fprintf(out, "%s    %-28s %14llu\n", indent,
+                        bucket_range(desc, i).c_str(),
+                        (unsigned long long)d.second[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef API_STATS_HH
+#define API_STATS_HH
+
+#include "kvmxx.hh"
+#include <stdint.h>
+#include <stdio.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Whether the host has binary statistics (KVM_CAP_BINARY_STATS_FD); if
+// not, prints so on behalf of program prog.
+bool stats_supported(kvm::system& sys, const char* prog);
+
+// The binary statistics of a VM or vcpu (KVM_GET_STATS_FD).  The
+// descriptors are read once; read() returns the values of each
+// descriptor in turn, size of them (one per bucket for a histogram).
+class stats_reader {
+public:
+    struct descriptor {
+        std::string name;
+        uint32_t flags;
+        int16_t exponent;
+        uint16_t size;
+        uint32_t offset;
+        uint32_t bucket_size;
+    };
+    explicit stats_reader(kvm::vm& vm);
+    explicit stats_reader(kvm::vcpu& vcpu);
+    const std::string& id() const { return _id; }
+    const std::vector<descriptor>& descriptors() const { return _descs; }
+    std::vector<uint64_t> read();
+    static bool cumulative(const descriptor& d);
+    static bool histogram(const descriptor& d);
+private:
+    void read_descriptors();
+    void pread_all(void* buf, size_t size, off_t offset);
+private:
+    kvm::fd _fd;
+    std::string _id;
+    uint32_t _data_offset;
+    std::vector<descriptor> _descs;
+    std::vector<uint64_t> _data;
+};
+
+// Snapshots the statistics of a VM and its vcpus before a benchmark
+// phase and prints the cumulative ones that changed after it, summed
+// over the vcpus.  Histograms print their sample count, followed by
+// the buckets that changed.
+class stats_delta {
+public:
+    void add(kvm::vm& vm);
+    void add(kvm::vcpu& vcpu);
+    // take a new "before" snapshot
+    void start();
+    // take the "after" snapshot now rather than in print(), so that the
+    // phase can be printed later
+    void stop();
+    void print(FILE* out, const char* indent = "  ");
+private:
+    struct source {
+        std::shared_ptr<stats_reader> reader;
+        std::vector<uint64_t> before;
+        std::vector<uint64_t> after;
+    };
+    std::vector<source> _sources;
+};
+
+#endif
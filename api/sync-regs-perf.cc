@@ -0,0 +1,113 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include "runloop.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace {
+
+const int bench_port = 0xe0;
+const unsigned iterations = 1000000;
+bool show_stats = false;
+
+// Guest: pass i to the host in eax and expect i + 1 back in ebx.
+void request_loop(unsigned* nr_bad)
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        unsigned long reply = 0;
+        asm volatile("outb %%al, %%dx"
+                     : "+b"(reply) : "a"(i), "d"(bench_port) : "memory");
+        if (reply != i + 1) {
+            ++*nr_bad;
+        }
+    }
+}
+
+// Run the guest, answering each request by updating its registers, print
+// the cost per round trip and return the number of wrong replies.
+unsigned exit_loop(kvm::system& sys, uint64_t sync_fields)
+{
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap);
+    kvm::vcpu vcpu(vm, 0);
+    unsigned nr_bad = 0;
+
+    vcpu.enable_sync_regs(sync_fields);
+    identity::vcpu guest(vcpu, std::bind(request_loop, &nr_bad));
+    stats_delta stats;
+    if (show_stats) {
+        stats.add(vm);
+        stats.add(vcpu);
+    }
+
+    kvm_run* run = vcpu.shared();
+    unsigned nr_exits = 0;
+    unsigned long ioctls_before = vcpu.nr_ioctls();
+    uint64_t start_ns = time_ns();
+    while (true) {
+        vcpu.run();
+        if (run->exit_reason != KVM_EXIT_IO || run->io.port != bench_port) {
+            break;
+        }
+        kvm_regs regs = vcpu.regs();
+        regs.rbx = regs.rax + 1;
+        vcpu.set_regs(regs);
+        ++nr_exits;
+    }
+    uint64_t ns = time_ns() - start_ns;
+    unsigned long nr_ioctls = vcpu.nr_ioctls() - ioctls_before;
+
+    printf("%-10s %10u exits, %6.2f ioctls/exit, %8.1f ns/exit%s\n",
+           sync_fields ? "sync-regs" : "ioctl", nr_exits,
+           double(nr_ioctls) / nr_exits, double(ns) / nr_exits,
+           nr_bad ? ", BAD REPLIES" : "");
+    if (show_stats) {
+        stats.print(stdout);
+    }
+    return nr_bad;
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+
+    while ((opt = getopt(ac, av, "S")) != -1) {
+        switch (opt) {
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("sync-regs-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+}
+
+int test_main(int ac, char** av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+    if (show_stats && !stats_supported(sys, "sync-regs-perf")) {
+        return 1;
+    }
+
+    if (!(sys.get_extension_int(KVM_CAP_SYNC_REGS) & KVM_SYNC_X86_REGS)) {
+        printf("sync-regs-perf: KVM_CAP_SYNC_REGS not supported\n");
+        return 1;
+    }
+    unsigned nr_bad = exit_loop(sys, 0);
+    nr_bad += exit_loop(sys, KVM_SYNC_X86_REGS);
+    return nr_bad ? 1 : 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
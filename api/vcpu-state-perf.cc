@@ -0,0 +1,189 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "memmap.hh"
+#include "runloop.hh"
+#include "vcpustate.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int max_vcpus = 256;
+int nr_reps = 100;
+bool show_stats = false;
+
+void guest_nop()
+{
+}
+
+// One host thread per vcpu, like a VMM's migration threads.
+struct vcpu_ctx {
+    std::unique_ptr<kvm::vcpu> vcpu;
+    std::unique_ptr<identity::vcpu> guest;
+    std::unique_ptr<vcpu_state> state;
+    latency_histogram save_stats;
+    latency_histogram restore_stats;
+};
+
+void save_loop(vcpu_ctx* ctx)
+{
+    for (int i = 0; i < nr_reps; ++i) {
+        uint64_t start_ns = time_ns();
+        ctx->state->save(*ctx->vcpu);
+        ctx->save_stats.add(time_ns() - start_ns);
+    }
+}
+
+void restore_loop(vcpu_ctx* ctx)
+{
+    for (int i = 0; i < nr_reps; ++i) {
+        uint64_t start_ns = time_ns();
+        ctx->state->restore(*ctx->vcpu);
+        ctx->restore_stats.add(time_ns() - start_ns);
+    }
+}
+
+// Run fn for every vcpu in parallel and return the wall time per
+// repetition, i.e. how long saving or restoring the whole VM takes.
+uint64_t parallel(std::vector<vcpu_ctx>& ctxs, void (*fn)(vcpu_ctx*))
+{
+    std::vector<std::thread> threads;
+
+    uint64_t start_ns = time_ns();
+    for (auto& ctx : ctxs) {
+        threads.push_back(std::thread(fn, &ctx));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return (time_ns() - start_ns) / nr_reps;
+}
+
+void run(kvm::system& sys, int nr_vcpus)
+{
+    kvm::vm vm(sys);
+    vm.create_irqchip();
+    mem_map memmap(vm);
+    // the in-kernel LAPIC page stays out of guest memory
+    identity::hole hole(reinterpret_cast<void*>(identity::apic_page), 4096);
+    identity::vm ident_vm(vm, memmap, hole);
+
+    std::vector<vcpu_ctx> ctxs(nr_vcpus);
+    for (int i = 0; i < nr_vcpus; ++i) {
+        vcpu_ctx& ctx = ctxs[i];
+        ctx.vcpu.reset(new kvm::vcpu(vm, i));
+        ctx.guest.reset(new identity::vcpu(*ctx.vcpu, guest_nop, 16 * 1024));
+        ctx.state.reset(new vcpu_state(*ctx.vcpu));
+    }
+    if (nr_vcpus == 1) {
+        printf("vcpu-state-perf: %u bytes per vcpu, %u MSRs\n",
+               ctxs[0].state->size(), ctxs[0].state->nr_msrs());
+        printf("%6s %12s %12s %12s %12s %12s %12s\n", "vcpus",
+               "save ns", "save p99 <=", "restore ns", "rest. p99 <=",
+               "VM save ns", "VM rest. ns");
+    }
+
+    stats_delta save_stats, restore_stats;
+    if (show_stats) {
+        save_stats.add(vm);
+        for (auto& ctx : ctxs) {
+            save_stats.add(*ctx.vcpu);
+        }
+    }
+    uint64_t vm_save_ns = parallel(ctxs, save_loop);
+    if (show_stats) {
+        save_stats.stop();
+        restore_stats.add(vm);
+        for (auto& ctx : ctxs) {
+            restore_stats.add(*ctx.vcpu);
+        }
+    }
+    uint64_t vm_restore_ns = parallel(ctxs, restore_loop);
+
+    latency_histogram save, restore;
+    for (auto& ctx : ctxs) {
+        save.merge(ctx.save_stats);
+        restore.merge(ctx.restore_stats);
+    }
+    printf("%6d %12.0f %12llu %12.0f %12llu %12llu %12llu\n", nr_vcpus,
+           save.mean(), (unsigned long long)save.percentile(99),
+           restore.mean(), (unsigned long long)restore.percentile(99),
+           (unsigned long long)vm_save_ns, (unsigned long long)vm_restore_ns);
+    if (show_stats) {
+        printf("  save:\n");
+        save_stats.print(stdout, "    ");
+        printf("  restore:\n");
+        restore_stats.print(stdout, "    ");
+    }
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+    long val;
+
+    while ((opt = getopt(ac, av, "v:n:S")) != -1) {
+        switch (opt) {
+        case 'v':
+        case 'n':
+            errno = 0;
+            val = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr) {
+                printf("vcpu-state-perf: Invalid number: -%c %s\n", opt,
+                       optarg);
+                exit(1);
+            }
+            if (opt == 'v') {
+                max_vcpus = val;
+            } else {
+                nr_reps = val;
+            }
+            break;
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("vcpu-state-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (max_vcpus <= 0 || nr_reps <= 0) {
+        printf("vcpu-state-perf: Invalid setting: %d vcpus, %d repetitions\n",
+               max_vcpus, nr_reps);
+        exit(1);
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    kvm::system sys;
+
+    parse_options(ac, av);
+    if (show_stats && !stats_supported(sys, "vcpu-state-perf")) {
+        return 1;
+    }
+    int kvm_max = sys.get_extension_int(KVM_CAP_MAX_VCPUS);
+    if (max_vcpus > kvm_max) {
+        printf("vcpu-state-perf: KVM supports only %d vcpus\n", kvm_max);
+        max_vcpus = kvm_max;
+    }
+    for (int n = 1; n <= max_vcpus; n *= 2) {
+        run(sys, n);
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
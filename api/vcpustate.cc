@@ -0,0 +1,98 @@
+#include "vcpustate.hh"
+#include <stdexcept>
+
+vcpu_state::vcpu_state(kvm::vcpu& vcpu)
+    : vcpu_state(vcpu, saved_msrs(vcpu))
+{
+}
+
+vcpu_state::vcpu_state(kvm::vcpu& vcpu, const std::vector<uint32_t>& msrs)
+    : _has_xsave(vcpu.sys().check_extension(KVM_CAP_XSAVE))
+    , _has_xcrs(vcpu.sys().check_extension(KVM_CAP_XCRS))
+    , _has_lapic(vcpu.irqchip())
+    , _msrs(msrs.size())
+{
+    if (_has_xsave) {
+        _xsave.resize((vcpu.xsave_size() + 7) / 8);
+    }
+    for (auto index : msrs) {
+        _msrs.add(index);
+    }
+}
+
+// The MSRs from KVM's list that this vcpu can read and write back;
+// some are only there on particular hosts or guest CPUID.
+std::vector<uint32_t> vcpu_state::saved_msrs(kvm::vcpu& vcpu)
+{
+    std::vector<uint32_t> saved;
+    kvm::msr_batch one(1);
+
+    for (auto index : vcpu.sys().msr_index_list()) {
+        one.clear();
+        one.add(index);
+        if (vcpu.get_msrs(one) == 1 && vcpu.set_msrs(one) == 1) {
+            saved.push_back(index);
+        }
+    }
+    return saved;
+}
+
+unsigned vcpu_state::size() const
+{
+    unsigned size = sizeof(_regs) + sizeof(_sregs) + sizeof(_mp_state)
+        + sizeof(_events) + sizeof(_debugregs)
+        + _msrs.size() * sizeof(kvm_msr_entry);
+    size += _has_xsave ? _xsave.size() * 8 : sizeof(_fpu);
+    size += _has_xcrs ? sizeof(_xcrs) : 0;
+    size += _has_lapic ? sizeof(_lapic) : 0;
+    return size;
+}
+
+// Same order as restore(), which follows QEMU's.
+void vcpu_state::save(kvm::vcpu& vcpu)
+{
+    _regs = vcpu.regs();
+    if (_has_xsave) {
+        vcpu.get_xsave(xsave());
+    } else {
+        _fpu = vcpu.fpu();
+    }
+    if (_has_xcrs) {
+        _xcrs = vcpu.xcrs();
+    }
+    _sregs = vcpu.sregs();
+    if (vcpu.get_msrs(_msrs) != _msrs.size()) {
+        throw std::runtime_error("vcpu_state: KVM_GET_MSRS failed");
+    }
+    _mp_state = vcpu.mp_state();
+    if (_has_lapic) {
+        _lapic = vcpu.lapic();
+    }
+    _events = vcpu.vcpu_events();
+    _debugregs = vcpu.debugregs();
+}
+
+// The vcpu events come after the LAPIC, so that a pending interrupt or
+// exception is not lost when the LAPIC state is replaced.
+void vcpu_state::restore(kvm::vcpu& vcpu) const
+{
+    vcpu.set_regs(_regs);
+    if (_has_xsave) {
+        vcpu.set_xsave(xsave());
+    } else {
+        vcpu.set_fpu(_fpu);
+    }
+    if (_has_xcrs) {
+        vcpu.set_xcrs(_xcrs);
+    }
+    vcpu.set_sregs(_sregs);
+    if (vcpu.set_msrs(_msrs) != _msrs.size()) {
+        throw std::runtime_error("vcpu_state: KVM_SET_MSRS failed");
+    }
+    vcpu.set_mp_state(_mp_state);
+    if (_has_lapic) {
+        vcpu.set_lapic(_lapic);
+    }
+    vcpu.set_vcpu_events(_events);
+    vcpu.set_debugregs(_debugregs);
+}
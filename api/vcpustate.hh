@@ -0,0 +1,46 @@
+#ifndef API_VCPUSTATE_HH
+#define API_VCPUSTATE_HH
+
+#include "kvmxx.hh"
+#include <stdint.h>
+#include <vector>
+
+// The complete state of a vcpu, as a VMM transfers it for migration or
+// a snapshot.  The buffers, including the list of MSRs worth saving,
+// are set up once from a template vcpu, so that save() and restore()
+// only issue ioctls; restore() may target a different vcpu, e.g. on
+// another VM.
+class vcpu_state {
+public:
+    explicit vcpu_state(kvm::vcpu& vcpu);
+    void save(kvm::vcpu& vcpu);
+    void restore(kvm::vcpu& vcpu) const;
+    unsigned nr_msrs() const { return _msrs.size(); }
+    // bytes moved by save() or restore()
+    unsigned size() const;
+private:
+    vcpu_state(kvm::vcpu& vcpu, const std::vector<uint32_t>& msrs);
+    static std::vector<uint32_t> saved_msrs(kvm::vcpu& vcpu);
+    vcpu_state(const vcpu_state&) = delete;
+    vcpu_state& operator=(const vcpu_state&) = delete;
+    kvm_xsave* xsave() { return reinterpret_cast<kvm_xsave*>(&_xsave[0]); }
+    const kvm_xsave* xsave() const {
+        return reinterpret_cast<const kvm_xsave*>(&_xsave[0]);
+    }
+private:
+    bool _has_xsave;
+    bool _has_xcrs;
+    bool _has_lapic;
+    kvm_regs _regs;
+    kvm_sregs _sregs;
+    kvm_fpu _fpu;
+    std::vector<uint64_t> _xsave;
+    kvm_xcrs _xcrs;
+    kvm::msr_batch _msrs;
+    kvm_mp_state _mp_state;
+    kvm_lapic_state _lapic;
+    kvm_vcpu_events _events;
+    kvm_debugregs _debugregs;
+};
+
+#endif
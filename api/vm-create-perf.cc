@@ -0,0 +1,215 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "memmap.hh"
+#include "runloop.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int nr_threads = 0;		// 0 = powers of two up to the number of CPUs
+int vms_per_thread = 100;
+bool show_stats = false;
+
+enum phase {
+    create_vm,		// KVM_CREATE_VM
+    memslots,		// the identity VM's memory slots, TSS and EPT pages
+    create_vcpu,	// KVM_CREATE_VCPU, kvm_run mmap and initial state
+    first_run,		// the first KVM_RUN, to the guest's exit
+    destroy,		// closing the vcpu and VM file descriptors
+    nr_phases,
+};
+
+const char* phase_names[nr_phases] = {
+    "create_vm", "memslots", "create_vcpu", "first_run", "close",
+};
+
+void guest_nop()
+{
+}
+
+// Build, run and tear down nr_vms VMs one after another, the way a
+// VMM would for a short-lived guest.
+void churn(int nr_vms, latency_histogram* stats)
+{
+    kvm::system sys;
+
+    for (int i = 0; i < nr_vms; ++i) {
+        uint64_t t[nr_phases + 1];
+        t[create_vm] = time_ns();
+        std::unique_ptr<kvm::vm> vm(new kvm::vm(sys));
+        t[memslots] = time_ns();
+        std::unique_ptr<mem_map> memmap(new mem_map(*vm));
+        std::unique_ptr<identity::vm> ident_vm(new identity::vm(*vm, *memmap));
+        t[create_vcpu] = time_ns();
+        std::unique_ptr<kvm::vcpu> vcpu(new kvm::vcpu(*vm, 0));
+        std::unique_ptr<identity::vcpu> guest(new identity::vcpu(*vcpu,
+                                                                 guest_nop));
+        t[first_run] = time_ns();
+        vcpu->run();
+        t[destroy] = time_ns();
+        guest.reset();
+        vcpu.reset();
+        ident_vm.reset();
+        memmap.reset();
+        vm.reset();
+        t[nr_phases] = time_ns();
+        for (int p = 0; p < nr_phases; ++p) {
+            stats[p].add(t[p + 1] - t[p]);
+        }
+    }
+}
+
+// Worker thread body.  Errors (e.g. EMFILE or ENOMEM with many threads)
+// must not escape the thread; run() rethrows them after join().
+void churn_thread(int nr_vms, latency_histogram* stats,
+                  std::exception_ptr* error)
+{
+    try {
+        churn(nr_vms, stats);
+    } catch (...) {
+        *error = std::current_exception();
+    }
+}
+
+void run(int threads)
+{
+    std::vector<std::vector<latency_histogram> > stats(threads);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+
+    uint64_t start_ns = time_ns();
+    for (int i = 0; i < threads; ++i) {
+        stats[i].resize(nr_phases);
+        workers.push_back(std::thread(churn_thread, vms_per_thread,
+                                      stats[i].data(), &errors[i]));
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    uint64_t ns = time_ns() - start_ns;
+    for (auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+
+    printf("\n%d threads, %d VMs: %.1f VMs/sec\n", threads,
+           threads * vms_per_thread, threads * vms_per_thread * 1e9 / ns);
+    printf("%-12s %12s %12s %12s %12s\n", "phase",
+           "mean ns", "p50 ns <=", "p99 ns <=", "max ns");
+    for (int p = 0; p < nr_phases; ++p) {
+        latency_histogram total;
+        for (auto& s : stats) {
+            total.merge(s[p]);
+        }
+        printf("%-12s %12.0f %12llu %12llu %12llu\n", phase_names[p],
+               total.mean(), (unsigned long long)total.percentile(50),
+               (unsigned long long)total.percentile(99),
+               (unsigned long long)total.max());
+    }
+}
+
+// Build one more VM the same way, untimed, and print what each phase
+// changes in its statistics.  KVM_CREATE_VM and closing have none to
+// show, as the VM's statistics only exist in between.
+void print_phase_stats()
+{
+    kvm::system sys;
+    kvm::vm vm(sys);
+    stats_delta stats;
+    stats.add(vm);
+
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap);
+    printf("\nkvm stats, %s:\n", phase_names[memslots]);
+    stats.print(stdout);
+    stats.start();
+
+    kvm::vcpu vcpu(vm, 0);
+    identity::vcpu guest(vcpu, guest_nop);
+    printf("kvm stats, %s:\n", phase_names[create_vcpu]);
+    stats.print(stdout);
+    stats.add(vcpu);
+
+    vcpu.run();
+    printf("kvm stats, %s:\n", phase_names[first_run]);
+    stats.print(stdout);
+}
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+    long val;
+
+    while ((opt = getopt(ac, av, "t:n:S")) != -1) {
+        switch (opt) {
+        case 't':
+        case 'n':
+            errno = 0;
+            val = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr) {
+                printf("vm-create-perf: Invalid number: -%c %s\n", opt, optarg);
+                exit(1);
+            }
+            if (opt == 't') {
+                nr_threads = val;
+            } else {
+                vms_per_thread = val;
+            }
+            break;
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("vm-create-perf: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (nr_threads < 0 || vms_per_thread <= 0) {
+        printf("vm-create-perf: Invalid setting: %d threads, %d VMs\n",
+               nr_threads, vms_per_thread);
+        exit(1);
+    }
+}
+
+int test_main(int ac, char **av)
+{
+    parse_options(ac, av);
+    if (show_stats) {
+        kvm::system sys;
+        if (!stats_supported(sys, "vm-create-perf")) {
+            return 1;
+        }
+    }
+
+    printf("vm-create-perf: %d VMs per thread\n", vms_per_thread);
+    if (nr_threads) {
+        run(nr_threads);
+    } else {
+        int nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int threads = 1; threads <= nr_cpus; threads *= 2) {
+            run(threads);
+        }
+    }
+    if (show_stats) {
+        print_phase_stats();
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
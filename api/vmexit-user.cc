@@ -0,0 +1,192 @@
+#include "kvmxx.hh"
+#include "identity.hh"
+#include "runloop.hh"
+#include "stats.hh"
+#include "exception.hh"
+#include <linux/kvm_para.h>
+#include <x86intrin.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace {
+
+const int bench_port = 0xe0;
+unsigned iterations = 100000;
+bool show_stats = false;
+volatile uint32_t* mmio_addr;
+
+void guest_pio()
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        asm volatile("outb %%al, %%dx" : : "a"(0), "d"(bench_port));
+    }
+}
+
+// mmio_addr is left out of the guest memory map
+void guest_mmio()
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        *mmio_addr = i;
+    }
+}
+
+void guest_hlt()
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        asm volatile("hlt");
+    }
+}
+
+// KVM_HC_MAP_GPA_RANGE is the hypercall KVM can forward to userspace
+void hypercall()
+{
+    unsigned long ret;
+    asm volatile("vmcall"
+                 : "=a"(ret)
+                 : "a"(KVM_HC_MAP_GPA_RANGE), "b"(0), "c"(1), "d"(0)
+                 : "memory");
+}
+
+void guest_hypercall()
+{
+    for (unsigned i = 0; i < iterations; ++i) {
+        hypercall();
+    }
+}
+
+bool resume(kvm::vcpu& vcpu)
+{
+    return true;
+}
+
+bool complete_hypercall(kvm::vcpu& vcpu)
+{
+    vcpu.shared()->hypercall.ret = 0;
+    return true;
+}
+
+// KVM_CAP_EXIT_HYPERCALL only says that KVM can forward hypercalls; it
+// may still handle this one in the kernel (e.g. depending on the VM type
+// or guest CPUID), so try one and see whether it reaches userspace.
+bool hypercall_forwarded(kvm::vcpu& vcpu)
+{
+    identity::vcpu guest(vcpu, hypercall);
+    guest.enter_cpl0();
+    run_loop loop(vcpu);
+    loop.on_exit(KVM_EXIT_HYPERCALL, complete_hypercall);
+    loop.run();
+    return loop.stats(KVM_EXIT_HYPERCALL).count() == 1;
+}
+
+struct test {
+    const char* name;
+    void (*guest)();
+    uint32_t exit_reason;
+    bool cpl0;
+};
+
+const test tests[] = {
+    { "pio", guest_pio, KVM_EXIT_IO, false },
+    { "mmio", guest_mmio, KVM_EXIT_MMIO, false },
+    { "hlt", guest_hlt, KVM_EXIT_HLT, true },
+    { "hypercall", guest_hypercall, KVM_EXIT_HYPERCALL, true },
+};
+
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+
+    while ((opt = getopt(ac, av, "S")) != -1) {
+        switch (opt) {
+        case 'S':
+            show_stats = true;
+            break;
+        default:
+            printf("vmexit-user: Invalid option\n");
+            exit(1);
+        }
+    }
+    if (optind < ac) {
+        iterations = atoi(av[optind]);
+    }
+}
+
+int test_main(int ac, char** av)
+{
+    parse_options(ac, av);
+
+    kvm::system sys;
+    if (show_stats && !stats_supported(sys, "vmexit-user")) {
+        return 1;
+    }
+    kvm::vm vm(sys);
+    bool hypercall_exit = sys.check_extension(KVM_CAP_EXIT_HYPERCALL);
+    if (hypercall_exit) {
+        vm.enable_cap(KVM_CAP_EXIT_HYPERCALL, 1ULL << KVM_HC_MAP_GPA_RANGE);
+    }
+    mem_map memmap(vm);
+
+    void* hole_page;
+    int ret = posix_memalign(&hole_page, 4096, 4096);
+    if (ret) {
+        throw errno_exception(ret);
+    }
+    mmio_addr = static_cast<volatile uint32_t*>(hole_page);
+    identity::hole hole(hole_page, 4096);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+
+    if (hypercall_exit && !hypercall_forwarded(vcpu)) {
+        hypercall_exit = false;
+        printf("vmexit-user: hypercall exits enabled, but not forwarded\n");
+    }
+
+    double scale = tsc_per_ns();
+    printf("%-10s %10s %12s %12s %12s\n", "exit", "exits",
+           "kernel cyc", "user cyc", "total cyc");
+    for (auto& t : tests) {
+        if (t.exit_reason == KVM_EXIT_HYPERCALL && !hypercall_exit) {
+            printf("%-10s skipped, no KVM_EXIT_HYPERCALL\n", t.name);
+            continue;
+        }
+        identity::vcpu guest(vcpu, t.guest);
+        stats_delta stats;
+        if (show_stats) {
+            stats.add(vm);
+            stats.add(vcpu);
+        }
+        if (t.cpl0) {
+            guest.enter_cpl0();
+        }
+        run_loop loop(vcpu);
+        loop.on_pio(bench_port, resume);
+        loop.on_mmio(identity::gpa(hole_page), 4096, resume);
+        loop.on_hlt(resume);
+        loop.on_exit(KVM_EXIT_HYPERCALL, complete_hypercall);
+        loop.run();
+
+        // time in KVM_RUN, including the few guest instructions per exit
+        const latency_histogram& kernel = loop.run_stats(t.exit_reason);
+        const latency_histogram& user = loop.stats(t.exit_reason);
+        if (user.count() != iterations) {
+            printf("%-10s FAIL: %llu exits, expected %u\n", t.name,
+                   (unsigned long long)user.count(), iterations);
+            return 1;
+        }
+        printf("%-10s %10llu %12.0f %12.0f %12.0f\n", t.name,
+               (unsigned long long)user.count(), kernel.mean() * scale,
+               user.mean() * scale, (kernel.mean() + user.mean()) * scale);
+        if (show_stats) {
+            stats.print(stdout);
+        }
+    }
+    return 0;
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -0,0 +1,261 @@
+/*
+ * Machine-readable results for latency and throughput tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include "libcflat.h"
+#include "results.h"
+
+#define MAX_CONFIG 16
+
+enum result_format result_format = RESULT_TEXT;
+
+static struct {
+	const char *key;
+	char value[32];
+} config[MAX_CONFIG];
+static int nr_config;
+static bool csv_header_done;
+
+bool result_parse_arg(const char *arg)
+{
+	if (strcmp(arg, "format=text") == 0)
+		result_format = RESULT_TEXT;
+	else if (strcmp(arg, "format=json") == 0)
+		result_format = RESULT_JSON;
+	else if (strcmp(arg, "format=csv") == 0)
+		result_format = RESULT_CSV;
+	else
+		return false;
+	return true;
+}
+
+void result_init(struct result *r, const char *name, const char *unit)
+{
+	r->name = name;
+	r->unit = unit;
+	r->cpu = -1;
+	r->count = r->mean = r->min = r->max = RESULT_NONE;
+	r->p50 = r->p90 = r->p99 = r->p999 = RESULT_NONE;
+	r->stddev = RESULT_NONE;
+}
+
+/* In-place heapsort, the samples can be too many for anything quadratic. */
+static void sift_down(u64 *a, unsigned start, unsigned n)
+{
+	unsigned root = start, child;
+	u64 tmp;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && a[child] < a[child + 1])
+			child++;
+		if (a[root] >= a[child])
+			return;
+		tmp = a[root];
+		a[root] = a[child];
+		a[child] = tmp;
+		root = child;
+	}
+}
+
+static void sort_samples(u64 *a, unsigned n)
+{
+	unsigned i;
+	u64 tmp;
+
+	for (i = n / 2; i-- > 0; )
+		sift_down(a, i, n);
+	for (i = n; i-- > 1; ) {
+		tmp = a[0];
+		a[0] = a[i];
+		a[i] = tmp;
+		sift_down(a, 0, i);
+	}
+}
+
+static u64 isqrt(u64 x)
+{
+	u64 r = 0, bit = 1ull << 62;
+
+	while (bit > x)
+		bit >>= 2;
+	while (bit) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+	return r;
+}
+
+/* The sample at the given per-mille rank of a sorted buffer. */
+static u64 permille(u64 *sorted, unsigned n, unsigned pm)
+{
+	return sorted[(u64)(n - 1) * pm / 1000];
+}
+
+/*
+ * Sum (x - mean)^2 / n in quotient and remainder, so that it cannot
+ * overflow; deviations are capped at 2^32 - 1.
+ */
+static u64 stddev(u64 *a, unsigned n, u64 mean)
+{
+	u64 var = 0, rem = 0, d;
+	unsigned i;
+
+	for (i = 0; i < n; ++i) {
+		d = a[i] > mean ? a[i] - mean : mean - a[i];
+		if (d > 0xffffffffull)
+			d = 0xffffffffull;
+		d *= d;
+		var += d / n;
+		rem += d % n;
+		if (rem >= n) {
+			var++;
+			rem -= n;
+		}
+	}
+	return isqrt(var);
+}
+
+void result_from_samples(struct result *r, u64 *samples, unsigned n)
+{
+	u64 sum = 0;
+	unsigned i;
+
+	if (!n)
+		return;
+	sort_samples(samples, n);
+	for (i = 0; i < n; ++i)
+		sum += samples[i];
+	r->count = n;
+	r->mean = sum / n;
+	r->min = samples[0];
+	r->max = samples[n - 1];
+	r->p50 = permille(samples, n, 500);
+	r->p90 = permille(samples, n, 900);
+	r->p99 = permille(samples, n, 990);
+	r->p999 = permille(samples, n, 999);
+	r->stddev = stddev(samples, n, r->mean);
+}
+
+void result_config(const char *key, const char *value_fmt, ...)
+{
+	va_list va;
+	int i;
+
+	for (i = 0; i < nr_config; ++i)
+		if (strcmp(config[i].key, key) == 0)
+			break;
+	assert_msg(i < MAX_CONFIG, "too many result_config() keys");
+	if (i == nr_config) {
+		config[i].key = key;
+		nr_config++;
+	}
+	va_start(va, value_fmt);
+	vsnprintf(config[i].value, sizeof(config[i].value), value_fmt, va);
+	va_end(va);
+}
+
+static const char *stat_names[] = {
+	"mean", "min", "max", "p50", "p90", "p99", "p99.9", "stddev",
+};
+
+static void result_stats(const struct result *r, u64 *stats)
+{
+	stats[0] = r->mean;
+	stats[1] = r->min;
+	stats[2] = r->max;
+	stats[3] = r->p50;
+	stats[4] = r->p90;
+	stats[5] = r->p99;
+	stats[6] = r->p999;
+	stats[7] = r->stddev;
+}
+
+/*
+ * Names and config values are plain identifiers or numbers, so only
+ * quotes and backslashes need escaping.
+ */
+static void print_json_string(const char *s)
+{
+	printf("\"");
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			printf("\\");
+		printf("%c", *s);
+	}
+	printf("\"");
+}
+
+static void emit_json(const struct result *r)
+{
+	u64 stats[ARRAY_SIZE(stat_names)];
+	int i;
+
+	result_stats(r, stats);
+	printf("{\"name\": ");
+	print_json_string(r->name);
+	printf(", \"unit\": ");
+	print_json_string(r->unit);
+	printf(", \"cpu\": %d", r->cpu);
+	if (r->count != RESULT_NONE)
+		printf(", \"count\": %" PRIu64, r->count);
+	for (i = 0; i < ARRAY_SIZE(stat_names); ++i)
+		if (stats[i] != RESULT_NONE)
+			printf(", \"%s\": %" PRIu64, stat_names[i], stats[i]);
+	printf(", \"config\": {");
+	for (i = 0; i < nr_config; ++i) {
+		if (i)
+			printf(", ");
+		print_json_string(config[i].key);
+		printf(": ");
+		print_json_string(config[i].value);
+	}
+	printf("}}\n");
+}
+
+static void emit_csv(const struct result *r)
+{
+	u64 stats[ARRAY_SIZE(stat_names)];
+	int i;
+
+	if (!csv_header_done) {
+		printf("name,unit,cpu,count");
+		for (i = 0; i < ARRAY_SIZE(stat_names); ++i)
+			printf(",%s", stat_names[i]);
+		printf(",config\n");
+		csv_header_done = true;
+	}
+	result_stats(r, stats);
+	printf("%s,%s,%d,", r->name, r->unit, r->cpu);
+	if (r->count != RESULT_NONE)
+		printf("%" PRIu64, r->count);
+	for (i = 0; i < ARRAY_SIZE(stat_names); ++i) {
+		printf(",");
+		if (stats[i] != RESULT_NONE)
+			printf("%" PRIu64, stats[i]);
+	}
+	/* key=value pairs, separated by semicolons to stay one column */
+	printf(",");
+	for (i = 0; i < nr_config; ++i)
+		printf("%s%s=%s", i ? ";" : "", config[i].key, config[i].value);
+	printf("\n");
+}
+
+void result_emit(const struct result *r)
+{
+	switch (result_format) {
+	case RESULT_JSON:
+		emit_json(r);
+		break;
+	case RESULT_CSV:
+		emit_csv(r);
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef _RESULTS_H_
+#define _RESULTS_H_
+/*
+ * Machine-readable results for latency and throughput tests
+ *
+ * A test passes each of its command line arguments to result_parse_arg(),
+ * which picks out "format=json" or "format=csv".  In those formats every
+ * result_emit() prints one line: a JSON object, or a CSV row after a
+ * header row printed once.  The default "text" format emits nothing, and
+ * the test prints its usual output instead.  Tests print free-form lines
+ * only in the text format, and pass the values worth keeping from them
+ * to result_config(), so that the other formats parse as they are.
+ *
+ * Statistics that a test does not measure are left at RESULT_NONE and
+ * omitted from the output.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.
+ */
+#include "libcflat.h"
+
+enum result_format {
+	RESULT_TEXT,
+	RESULT_JSON,
+	RESULT_CSV,
+};
+
+#define RESULT_NONE (~0ull)
+
+struct result {
+	const char *name;
+	const char *unit;	/* e.g. "cycles" */
+	int cpu;		/* -1 if not specific to one CPU */
+	u64 count;		/* iterations or samples behind the numbers */
+	u64 mean, min, max;
+	u64 p50, p90, p99, p999;
+	u64 stddev;
+};
+
+extern enum result_format result_format;
+
+/*
+ * Returns true if arg selected the output format; false if it is
+ * something for the test itself.
+ */
+extern bool result_parse_arg(const char *arg);
+
+/* Set every statistic to RESULT_NONE and cpu to -1. */
+extern void result_init(struct result *r, const char *name,
+			const char *unit);
+
+/*
+ * Fill count, mean, min, max, the percentiles and the standard deviation
+ * from n samples.  Sorts the samples in place.
+ */
+extern void result_from_samples(struct result *r, u64 *samples, unsigned n);
+
+/*
+ * Record a configuration value (CPU count, test parameters, ...) that
+ * is attached to every result emitted afterwards.
+ */
+extern void result_config(const char *key, const char *value_fmt, ...)
+					__attribute__((format(printf, 2, 3)));
+
+extern void result_emit(const struct result *r);
+
+#endif
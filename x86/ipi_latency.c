@@ -0,0 +1,252 @@
+/*
+ * IPI latency between every pair of CPUs, in x2APIC and xAPIC mode
+ *
+ * For each (sender, receiver) pair the sender sends fixed IPIs to the
+ * receiver, which waits in HLT and answers each one with an IPI back.
+ * The round trip is timed with the sender's TSC alone; the one-way
+ * latency, from the ICR write to the receiver's handler, compares the
+ * two CPUs' TSCs and so relies on KVM keeping them synchronized.
+ *
+ * Arguments: "samples=N" sets the number of IPIs per pair, and
+ * "format=json" or "format=csv" replace the matrices with one result
+ * per pair and metric.
+ */
+#include "libcflat.h"
+#include "apic.h"
+#include "vm.h"
+#include "smp.h"
+#include "isr.h"
+#include "msr.h"
+#include "processor.h"
+#include "util.h"
+#include "results.h"
+
+#define PING_VECTOR	0xb0
+#define PONG_VECTOR	0xb1
+#define DONE_VECTOR	0xb2
+
+#define MAX_CPUS	64
+#define DEFAULT_SAMPLES	1000
+#define MAX_SAMPLES	100000
+#define WARMUP_SAMPLES	10
+
+enum { ONE_WAY, ROUND_TRIP, NR_METRICS };
+
+static const char *metric_names[NR_METRICS] = { "one_way", "round_trip" };
+
+static int nr_cpus;
+static unsigned nr_samples = DEFAULT_SAMPLES;
+static u64 samples[NR_METRICS][MAX_SAMPLES];
+static struct result results[NR_METRICS][MAX_CPUS][MAX_CPUS];
+
+static volatile int sender;
+static volatile u64 ping_tsc;
+static volatile bool pong;
+static volatile bool pair_done;
+
+static void send_ipi(int vector, int dest)
+{
+	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED |
+		       vector, dest);
+}
+
+static void ping_isr(isr_regs_t *regs)
+{
+	ping_tsc = rdtsc();
+	eoi();
+	send_ipi(PONG_VECTOR, sender);
+}
+
+static void pong_isr(isr_regs_t *regs)
+{
+	pong = true;
+	eoi();
+}
+
+/* Only there to wake the BSP up. */
+static void done_isr(isr_regs_t *regs)
+{
+	eoi();
+}
+
+/*
+ * Runs on the sender, from on_cpu_async() on an AP, so the IPI that
+ * brought it here has already been acknowledged and the pongs can
+ * nest inside it.
+ */
+static void ping_pong(void *data)
+{
+	int receiver = (long)data;
+	u64 t0, t1;
+	int i;
+
+	sender = smp_id();
+	irq_enable();
+	for (i = -WARMUP_SAMPLES; i < (int)nr_samples; ++i) {
+		pong = false;
+		t0 = rdtsc();
+		send_ipi(PING_VECTOR, receiver);
+		while (!pong)
+			pause();
+		t1 = rdtsc();
+		if (i < 0)
+			continue;
+		samples[ROUND_TRIP][i] = t1 - t0;
+		/* slightly unsynchronized TSCs could make it negative */
+		samples[ONE_WAY][i] = ping_tsc > t0 ? ping_tsc - t0 : 0;
+	}
+	pair_done = true;
+	if (sender != 0)
+		send_ipi(DONE_VECTOR, 0);
+}
+
+/*
+ * The BSP waits halted like the other receivers, so that a column
+ * does not look faster just because its CPU was polling.
+ */
+static void measure(const char *mode, int s, int r)
+{
+	int m;
+
+	pair_done = false;
+	if (s == 0) {
+		ping_pong((void *)(long)r);
+	} else {
+		on_cpu_async(s, ping_pong, (void *)(long)r);
+		irq_disable();
+		while (!pair_done) {
+			safe_halt();
+			irq_disable();
+		}
+		irq_enable();
+	}
+
+	result_config("mode", "%s", mode);
+	result_config("receiver", "%d", r);
+	for (m = 0; m < NR_METRICS; ++m) {
+		result_init(&results[m][s][r], metric_names[m], "cycles");
+		results[m][s][r].cpu = s;
+		result_from_samples(&results[m][s][r], samples[m], nr_samples);
+		result_emit(&results[m][s][r]);
+	}
+}
+
+/* pct is 50 or 99 */
+static void print_matrix(const char *mode, int m, int pct)
+{
+	struct result *res;
+	int s, r;
+	u64 v;
+
+	printf("\n%s %s p%d, cycles (rows: sender, columns: receiver)\n",
+	       mode, metric_names[m], pct);
+	printf("%4s", "");
+	for (r = 0; r < nr_cpus; ++r)
+		printf(" %8d", r);
+	printf("\n");
+	for (s = 0; s < nr_cpus; ++s) {
+		printf("%4d", s);
+		for (r = 0; r < nr_cpus; ++r) {
+			res = &results[m][s][r];
+			v = pct == 50 ? res->p50 : res->p99;
+			if (s == r)
+				printf(" %8s", "-");
+			else
+				printf(" %8" PRIu64, v);
+		}
+		printf("\n");
+	}
+}
+
+static void run_matrix(const char *mode)
+{
+	int s, r, m;
+
+	printf("\n%s: %u IPIs per pair\n", mode, nr_samples);
+	for (s = 0; s < nr_cpus; ++s)
+		for (r = 0; r < nr_cpus; ++r)
+			if (s != r)
+				measure(mode, s, r);
+
+	if (result_format != RESULT_TEXT)
+		return;
+	for (m = 0; m < NR_METRICS; ++m) {
+		print_matrix(mode, m, 50);
+		print_matrix(mode, m, 99);
+	}
+}
+
+/*
+ * An AP's half of switch_to_xapic().  It leaves the library's apic_ops
+ * alone, since the BSP keeps using them in x2APIC mode until it
+ * switches last.
+ */
+static void ap_xapic_mode(void *junk)
+{
+	u64 base = rdmsr(MSR_IA32_APICBASE) & ~(APIC_EN | APIC_EXTD);
+
+	wrmsr(MSR_IA32_APICBASE, base);
+	wrmsr(MSR_IA32_APICBASE, base | APIC_EN);
+	*(volatile u32 *)(APIC_DEFAULT_PHYS_BASE + APIC_SPIV) = 0x1ff;
+}
+
+static void switch_to_xapic(void)
+{
+	int cpu;
+
+	for (cpu = 1; cpu < cpu_count(); ++cpu)
+		on_cpu_async(cpu, ap_xapic_mode, NULL);
+	while (cpus_active() > 1)
+		pause();
+	reset_apic();
+	enable_apic();
+}
+
+int main(int ac, char **av)
+{
+	long val;
+	int i;
+
+	setup_vm();
+	smp_init();
+	mask_pic_interrupts();
+
+	for (i = 1; i < ac; ++i) {
+		if (result_parse_arg(av[i]))
+			continue;
+		if (parse_keyval(av[i], &val) == 7 &&
+		    strncmp(av[i], "samples", 7) == 0 && val > 0)
+			nr_samples = val < MAX_SAMPLES ? val : MAX_SAMPLES;
+		else
+			printf("ignoring argument %s\n", av[i]);
+	}
+
+	nr_cpus = cpu_count();
+	if (nr_cpus < 2) {
+		report_skip("ipi latency needs at least two CPUs");
+		return report_summary();
+	}
+	if (nr_cpus > MAX_CPUS) {
+		printf("measuring only the first %d of %d CPUs\n",
+		       MAX_CPUS, nr_cpus);
+		nr_cpus = MAX_CPUS;
+	}
+	result_config("cpus", "%d", nr_cpus);
+	result_config("samples", "%u", nr_samples);
+
+	handle_irq(PING_VECTOR, ping_isr);
+	handle_irq(PONG_VECTOR, pong_isr);
+	handle_irq(DONE_VECTOR, done_isr);
+	irq_enable();
+
+	/* the startup code enables x2APIC mode where it can */
+	if (rdmsr(MSR_IA32_APICBASE) & APIC_EXTD) {
+		run_matrix("x2apic");
+		switch_to_xapic();
+	} else {
+		printf("\nx2apic: not supported\n");
+	}
+	run_matrix("xapic");
+
+	return report_summary();
+}
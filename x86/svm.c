@@ -7,6 +7,7 @@
 #include "smp.h"
 #include "types.h"
 #include "alloc_page.h"
+#include "results.h"
 
 /* for the nested page table*/
 u64 *pml4e;
@@ -59,10 +60,12 @@ static void setup_svm(void)
 
     io_bitmap = (void *) (((ulong)io_bitmap_area + 4095) & ~4095);
 
+    result_config("npt", "%d", npt_supported());
     if (!npt_supported())
         return;
 
-    printf("NPT detected - running all tests with NPT enabled\n");
+    if (result_format == RESULT_TEXT)
+        printf("NPT detected - running all tests with NPT enabled\n");
 
     /*
      * Nested paging supported - Build a nested page table
@@ -932,8 +935,25 @@ static bool latency_finished(struct test *test)
     return runs == 0;
 }
 
+static void emit_latency(const char *name, u64 min, u64 max, u64 sum)
+{
+    struct result r;
+
+    result_init(&r, name, "cycles");
+    r.count = LATENCY_RUNS;
+    r.min = min;
+    r.max = max;
+    r.mean = sum / LATENCY_RUNS;
+    result_emit(&r);
+}
+
 static bool latency_check(struct test *test)
 {
+    if (result_format != RESULT_TEXT) {
+        emit_latency("svm_vmrun", latvmrun_min, latvmrun_max, vmrun_sum);
+        emit_latency("svm_vmexit", latvmexit_min, latvmexit_max, vmexit_sum);
+        return true;
+    }
     printf("    Latency VMRUN : max: %ld min: %ld avg: %ld\n", latvmrun_max,
             latvmrun_min, vmrun_sum / LATENCY_RUNS);
     printf("    Latency VMEXIT: max: %ld min: %ld avg: %ld\n", latvmexit_max,
@@ -998,6 +1018,13 @@ static bool lat_svm_insn_finished(struct test *test)
 
 static bool lat_svm_insn_check(struct test *test)
 {
+    if (result_format != RESULT_TEXT) {
+        emit_latency("svm_vmload", latvmload_min, latvmload_max, vmload_sum);
+        emit_latency("svm_vmsave", latvmsave_min, latvmsave_max, vmsave_sum);
+        emit_latency("svm_stgi", latstgi_min, latstgi_max, stgi_sum);
+        emit_latency("svm_clgi", latclgi_min, latclgi_max, clgi_sum);
+        return true;
+    }
     printf("    Latency VMLOAD: max: %ld min: %ld avg: %ld\n", latvmload_max,
             latvmload_min, vmload_sum / LATENCY_RUNS);
     printf("    Latency VMSAVE: max: %ld min: %ld avg: %ld\n", latvmsave_max,
@@ -1062,6 +1089,9 @@ int main(int ac, char **av)
     setup_vm();
     smp_init();
 
+    for (i = 1; i < ac; i++)
+        result_parse_arg(av[i]);
+
     if (!(cpuid(0x80000001).c & 4)) {
         printf("SVM not availble\n");
         return report_summary();
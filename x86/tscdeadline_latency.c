@@ -27,13 +27,15 @@
 #include "desc.h"
 #include "isr.h"
 #include "msr.h"
+#include "results.h"
 
 static void test_lapic_existence(void)
 {
     u32 lvr;
 
     lvr = apic_read(APIC_LVR);
-    printf("apic version: %x\n", lvr);
+    if (result_format == RESULT_TEXT)
+        printf("apic version: %x\n", lvr);
     report("apic existence", (u16)lvr == 0x14);
 }
 
@@ -93,7 +95,8 @@ static int enable_tsc_deadline_timer(void)
 static void test_tsc_deadline_timer(void)
 {
     if(enable_tsc_deadline_timer()) {
-        printf("tsc deadline timer enabled\n");
+        if (result_format == RESULT_TEXT)
+            printf("tsc deadline timer enabled\n");
     } else {
         printf("tsc deadline timer not detected, aborting\n");
         abort();
@@ -102,7 +105,14 @@ static void test_tsc_deadline_timer(void)
 
 int main(int argc, char **argv)
 {
-    int i, size;
+    int i, size, nargs;
+    struct result r;
+
+    /* format=json|csv can go anywhere, the rest are positional */
+    for (i = 1, nargs = 1; i < argc; i++)
+        if (!result_parse_arg(argv[i]))
+            argv[nargs++] = argv[i];
+    argc = nargs;
 
     setup_vm();
     smp_init();
@@ -114,7 +124,8 @@ int main(int argc, char **argv)
     delta = argc <= 1 ? 200000 : atol(argv[1]);
     size = argc <= 2 ? TABLE_SIZE : atol(argv[2]);
     breakmax = argc <= 3 ? 0 : atol(argv[3]);
-    printf("breakmax=%d\n", breakmax);
+    if (result_format == RESULT_TEXT)
+        printf("breakmax=%d\n", breakmax);
     test_tsc_deadline_timer();
     irq_enable();
 
@@ -122,6 +133,16 @@ int main(int argc, char **argv)
         asm volatile("hlt");
     } while (!hitmax && table_idx < size);
 
+    if (result_format != RESULT_TEXT) {
+        result_config("delta", "%d", delta);
+        result_config("breakmax", "%d", breakmax);
+        result_config("hit_max", "%d", hitmax);
+        result_init(&r, "tscdeadline_latency", "cycles");
+        result_from_samples(&r, table, table_idx);
+        result_emit(&r);
+        return report_summary();
+    }
+
     for (i = 0; i < table_idx; i++) {
         if (hitmax && i == table_idx-1)
             printf("hit max: %d < ", breakmax);
@@ -8,6 +8,9 @@
 #include "x86/acpi.h"
 #include "x86/apic.h"
 #include "x86/isr.h"
+#include "fwcfg.h"
+#include "util.h"
+#include "results.h"
 
 #define IPI_TEST_VECTOR	0xb0
 
@@ -17,6 +20,7 @@ struct test {
 	int (*valid)(void);
 	int parallel;
 	bool (*next)(struct test *);
+	const char *label;	/* set by next(), replaces name in the output */
 };
 
 #define GOAL (1ull << 30)
@@ -200,6 +204,25 @@ static void inl_pmtimer(void)
     inl(pm_tmr_blk);
 }
 
+#define PM_TIMER_HZ 3579545
+
+static u64 tsc_khz;
+
+/* Count TSC ticks over 50 ms of the 24-bit ACPI PM timer. */
+static void calibrate_tsc(void)
+{
+	u32 start, ticks;
+	u64 t1, t2;
+
+	start = inl(pm_tmr_blk);
+	t1 = rdtsc();
+	do {
+		ticks = (inl(pm_tmr_blk) - start) & 0xffffff;
+	} while (ticks < PM_TIMER_HZ / 20);
+	t2 = rdtsc();
+	tsc_khz = (t2 - t1) * (PM_TIMER_HZ / 1000) / ticks;
+}
+
 static void inl_nop_qemu(void)
 {
     inl(0x1234);
@@ -251,6 +274,147 @@ static void wr_tsc_adjust_msr(void)
 	wrmsr(MSR_TSC_ADJUST, 0x0);
 }
 
+static void rd_apic_base_msr(void)
+{
+	rdmsr(MSR_IA32_APICBASE);
+}
+
+static u64 efer;
+
+static void wr_efer_msr(void)
+{
+	wrmsr(MSR_EFER, efer);
+}
+
+#ifdef __x86_64__
+/* Not intercepted by KVM, for the cost of the instructions alone. */
+static void rd_kernel_gs_base_msr(void)
+{
+	rdmsr(MSR_KERNEL_GS_BASE);
+}
+
+static void wr_kernel_gs_base_msr(void)
+{
+	wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+#endif
+
+#define X86_CR4_OSXSAVE 0x00040000
+#define XSTATE_FP_SSE 0x3
+
+static int has_xsave(void)
+{
+	return cpuid(1).c & (1 << 26);
+}
+
+static void enable_xsave(void *junk)
+{
+	write_cr4(read_cr4() | X86_CR4_OSXSAVE);
+}
+
+/* Only xsetbv runs with CR4.OSXSAVE set, the other tests see the default */
+static int xsave_setup(void)
+{
+	if (!has_xsave())
+		return 0;
+	on_cpus(enable_xsave, NULL);
+	return 1;
+}
+
+static void xsetbv(void)
+{
+	asm volatile(".byte 0x0f,0x01,0xd1" /* xsetbv */
+		     : : "a" (XSTATE_FP_SSE), "d" (0), "c" (0));
+}
+
+static char invlpg_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static void invlpg_test(void)
+{
+	invlpg(invlpg_page);
+}
+
+static void wbinvd(void)
+{
+	asm volatile("wbinvd" : : : "memory");
+}
+
+static int has_pmu(void)
+{
+	return cpuid(0).a >= 0xa && (cpuid(0xa).a & 0xff00);
+}
+
+static void rdpmc_test(void)
+{
+	rdpmc(0);
+}
+
+static int has_rdtscp(void)
+{
+	return cpuid(0x80000001).d & (1 << 27);
+}
+
+static void rdtscp_test(void)
+{
+	u32 aux;
+
+	rdtscp(&aux);
+}
+
+/*
+ * Each string instruction moves several bytes through the ELCR port, to
+ * compare with the single inb/outb of inl_from_kernel/outl_to_kernel.
+ */
+#define STRING_IO_COUNT 8
+
+static u8 string_io_buf[STRING_IO_COUNT];
+
+static void rep_insb_kernel(void)
+{
+	void *p = string_io_buf;
+	unsigned long count = STRING_IO_COUNT;
+
+	asm volatile("rep insb" : "+D" (p), "+c" (count) : "d" (0x4d0)
+		     : "memory");
+}
+
+static void rep_outsb_kernel(void)
+{
+	void *p = string_io_buf;
+	unsigned long count = STRING_IO_COUNT;
+
+	asm volatile("rep outsb" : "+S" (p), "+c" (count) : "d" (0x4d0)
+		     : "memory");
+}
+
+/*
+ * MMIO to a GPA without a memslot: after the first access KVM caches it as
+ * MMIO in the page tables (an EPT misconfiguration on Intel), and every
+ * later access takes the fast path out to userspace.  The address is in
+ * the PCI hole, below where firmware places BARs, so it is only unbacked
+ * while RAM ends below it.  The IOAPIC instead is emulated in the kernel.
+ */
+#define UNBACKED_GPA 0xd0000000ul
+#define IOAPIC_GPA 0xfec00000ul
+
+static volatile u32 *unbacked_mmio;
+static volatile u32 *ioapic_mmio;
+
+static int has_unbacked_gpa(void)
+{
+	return unbacked_mmio != NULL;
+}
+
+static void mmio_unbacked(void)
+{
+	(void)*unbacked_mmio;
+}
+
+static void mmio_ioapic(void)
+{
+	(void)*ioapic_mmio;	/* IOREGSEL */
+}
+
 static struct pci_test {
 	unsigned iobar;
 	unsigned ioport;
@@ -259,6 +423,7 @@ static struct pci_test {
 	int test_idx;
 	uint32_t data;
 	uint32_t offset;
+	char label[64];
 } pci_test = {
 	.test_idx = -1
 };
@@ -325,6 +490,7 @@ static bool pci_next(struct test *test, unsigned long addr, bool io)
 {
 	int i;
 	uint8_t width;
+	char name[32];
 
 	if (!pci_test.memaddr) {
 		test->func = NULL;
@@ -355,15 +521,17 @@ static bool pci_next(struct test *test, unsigned long addr, bool io)
 				io);
 	pci_test.offset = ioreadl(addr + offsetof(struct pci_test_dev_hdr,
 						  offset), io);
-	for (i = 0; i < pci_test.offset; ++i) {
-		char c = ioreadb(addr + offsetof(struct pci_test_dev_hdr,
-						 name) + i, io);
-		if (!c) {
+	for (i = 0; i < pci_test.offset && i < sizeof(name) - 1; ++i) {
+		name[i] = ioreadb(addr + offsetof(struct pci_test_dev_hdr,
+						  name) + i, io);
+		if (!name[i]) {
 			break;
 		}
-		printf("%c",c);
 	}
-	printf(":");
+	name[i] = 0;
+	snprintf(pci_test.label, sizeof(pci_test.label), "%s:%s", name,
+		 test->name);
+	test->label = pci_test.label;
 	return true;
 }
 
@@ -442,19 +610,196 @@ static struct test tests[] = {
 	{ ple_round_robin, "ple_round_robin", .parallel = 1 },
 	{ wr_tsc_adjust_msr, "wr_tsc_adjust_msr", .parallel = 1 },
 	{ rd_tsc_adjust_msr, "rd_tsc_adjust_msr", .parallel = 1 },
+	{ rd_apic_base_msr, "rd_apic_base_msr", .parallel = 1 },
+	{ wr_efer_msr, "wr_efer_msr", .parallel = 1 },
+#ifdef __x86_64__
+	{ rd_kernel_gs_base_msr, "rd_kernel_gs_base_msr", .parallel = 1 },
+	{ wr_kernel_gs_base_msr, "wr_kernel_gs_base_msr", .parallel = 1 },
+#endif
+	{ xsetbv, "xsetbv", xsave_setup, .parallel = 1 },
+	{ invlpg_test, "invlpg", .parallel = 1 },
+	{ wbinvd, "wbinvd", .parallel = 1 },
+	{ rdpmc_test, "rdpmc", has_pmu, .parallel = 1 },
+	{ rdtscp_test, "rdtscp", has_rdtscp, .parallel = 1 },
+	{ rep_insb_kernel, "rep_insb_from_kernel", .parallel = 1 },
+	{ rep_outsb_kernel, "rep_outsb_to_kernel", .parallel = 1 },
+	{ mmio_unbacked, "mmio_unbacked", has_unbacked_gpa, .parallel = 1 },
+	{ mmio_ioapic, "mmio_ioapic", .parallel = 1 },
 	{ NULL, "pci-mem", .parallel = 0, .next = pci_mem_next },
 	{ NULL, "pci-io", .parallel = 0, .next = pci_io_next },
 };
 
 unsigned iterations;
 
+/*
+ * Sampling mode ("samples=N" on the command line, or "histogram") times
+ * each of N iterations on its own instead of only the whole loop, so
+ * that preemptions and bimodal exit paths show up in the tail.  Each CPU
+ * running a parallel test fills its own part of the buffer.
+ */
+#define MAX_SAMPLES (1 << 20)
+#define DEFAULT_SAMPLES 100000
+#define WARMUP_ITERATIONS 1000
+
+static unsigned nr_samples;
+static bool print_histogram;
+static bool have_rdtscp;
+static u64 samples[MAX_SAMPLES];
+
+/*
+ * Parallel tests also time each CPU's loop, so that one slow vCPU is not
+ * averaged away by the others.
+ */
+#define MAX_CPUS 256
+
+static u64 cpu_cycles[MAX_CPUS];
+
+/*
+ * RDTSCP waits for the preceding instructions to finish, the LFENCE
+ * keeps the following ones from starting before the TSC is read.
+ */
+static inline u64 sample_tsc(void)
+{
+	u32 aux;
+	u64 tsc;
+
+	if (have_rdtscp) {
+		tsc = rdtscp(&aux);
+	} else {
+		asm volatile("lfence" : : : "memory");
+		tsc = rdtsc();
+	}
+	asm volatile("lfence" : : : "memory");
+	return tsc;
+}
+
 static void run_test(void *_func)
 {
     int i;
     void (*func)(void) = _func;
+    u64 t1 = rdtsc();
 
     for (i = 0; i < iterations; ++i)
         func();
+    cpu_cycles[smp_id()] = rdtsc() - t1;
+}
+
+static void run_test_sampled(void *_func)
+{
+	void (*func)(void) = _func;
+	u64 *buf = samples + smp_id() * nr_samples;
+	u64 t1;
+	int i;
+
+	for (i = 0; i < WARMUP_ITERATIONS; ++i)
+		func();
+	for (i = 0; i < nr_samples; ++i) {
+		t1 = sample_tsc();
+		func();
+		buf[i] = sample_tsc() - t1;
+	}
+}
+
+/* Index of the highest set bit, -1 for zero. */
+static int log2_bucket(u64 x)
+{
+	return x ? 63 - __builtin_clzll(x) : -1;
+}
+
+static void print_log2_histogram(u64 *sorted, unsigned n)
+{
+	unsigned i = 0, count;
+	int bucket;
+
+	while (i < n) {
+		bucket = log2_bucket(sorted[i]);
+		for (count = 0; i < n && log2_bucket(sorted[i]) == bucket; ++i)
+			count++;
+		if (bucket < 0)
+			printf("  %12d - %12d: %u\n", 0, 0, count);
+		else
+			printf("  %12" PRIu64 " - %12" PRIu64 ": %u\n",
+			       (u64)1 << bucket, ((u64)2 << bucket) - 1, count);
+	}
+}
+
+static void report_samples(const char *name, unsigned n)
+{
+	struct result r;
+
+	result_init(&r, name, "cycles");
+	result_from_samples(&r, samples, n);
+	if (result_format != RESULT_TEXT) {
+		result_emit(&r);
+		return;
+	}
+	printf("%s %" PRIu64 " min %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64
+	       " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64
+	       " stddev %" PRIu64 " samples %u\n",
+	       name, r.mean, r.min, r.p50, r.p90, r.p99, r.p999, r.max,
+	       r.stddev, n);
+	if (print_histogram)
+		print_log2_histogram(samples, n);
+}
+
+/*
+ * Statistics of each CPU's slice of a parallel test's samples.  They are
+ * computed before report_samples() sorts the whole buffer, and printed
+ * after it.
+ */
+static void report_cpu_samples(const char *name)
+{
+	static struct result r[MAX_CPUS];
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpus; ++cpu) {
+		result_init(&r[cpu], name, "cycles");
+		r[cpu].cpu = cpu;
+		result_from_samples(&r[cpu], samples + cpu * nr_samples,
+				    nr_samples);
+	}
+	report_samples(name, nr_samples * nr_cpus);
+	for (cpu = 0; cpu < nr_cpus; ++cpu) {
+		if (result_format != RESULT_TEXT)
+			result_emit(&r[cpu]);
+		else
+			printf("  cpu %d: %" PRIu64 " p50 %" PRIu64
+			       " p99 %" PRIu64 " max %" PRIu64 "\n", cpu,
+			       r[cpu].mean, r[cpu].p50, r[cpu].p99, r[cpu].max);
+	}
+}
+
+/*
+ * Cost per iteration on each CPU, and how many exits all of them
+ * together complete per second of wall clock time.
+ */
+static void report_cpus(const char *name, u64 wall_cycles)
+{
+	u64 wall_us = wall_cycles * 1000 / tsc_khz;
+	u64 rate = (u64)iterations * nr_cpus * 1000000 / wall_us;
+	struct result r;
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpus; ++cpu) {
+		if (result_format == RESULT_TEXT) {
+			printf("  cpu %d: %d\n", cpu,
+			       (int)(cpu_cycles[cpu] / iterations));
+			continue;
+		}
+		result_init(&r, name, "cycles");
+		r.cpu = cpu;
+		r.count = iterations;
+		r.mean = cpu_cycles[cpu] / iterations;
+		result_emit(&r);
+	}
+	if (result_format == RESULT_TEXT) {
+		printf("  total: %" PRIu64 " exits/sec\n", rate);
+	} else {
+		result_init(&r, name, "exits/sec");
+		r.count = (u64)iterations * nr_cpus;
+		r.mean = rate;
+		result_emit(&r);
+	}
 }
 
 static bool do_test(struct test *test)
@@ -462,11 +807,14 @@ static bool do_test(struct test *test)
 	int i;
 	unsigned long long t1, t2;
         void (*func)(void);
+	const char *name;
+	struct result r;
 
         iterations = 32;
 
         if (test->valid && !test->valid()) {
-		printf("%s (skipped)\n", test->name);
+		if (result_format == RESULT_TEXT)
+			printf("%s (skipped)\n", test->name);
 		return false;
 	}
 
@@ -476,10 +824,26 @@ static bool do_test(struct test *test)
 
 	func = test->func;
         if (!func) {
-		printf("%s (skipped)\n", test->name);
+		if (result_format == RESULT_TEXT)
+			printf("%s (skipped)\n", test->name);
 		return false;
 	}
 
+	name = test->label ? test->label : test->name;
+	if (nr_samples) {
+		if (!test->parallel) {
+			run_test_sampled(func);
+			report_samples(name, nr_samples);
+		} else {
+			on_cpus(run_test_sampled, func);
+			if (nr_cpus > 1)
+				report_cpu_samples(name);
+			else
+				report_samples(name, nr_samples);
+		}
+		return test->next;
+	}
+
 	do {
 		iterations *= 2;
 		t1 = rdtsc();
@@ -492,7 +856,16 @@ static bool do_test(struct test *test)
 		}
 		t2 = rdtsc();
 	} while ((t2 - t1) < GOAL);
-	printf("%s %d\n", test->name, (int)((t2 - t1) / iterations));
+	if (result_format == RESULT_TEXT) {
+		printf("%s %d\n", name, (int)((t2 - t1) / iterations));
+	} else {
+		result_init(&r, name, "cycles");
+		r.count = iterations;
+		r.mean = (t2 - t1) / iterations;
+		result_emit(&r);
+	}
+	if (test->parallel && nr_cpus > 1)
+		report_cpus(name, t2 - t1);
 	return test->next;
 }
 
@@ -516,25 +889,70 @@ bool test_wanted(struct test *test, char *wanted[], int nwanted)
 	return false;
 }
 
+/*
+ * Pick "samples=N", "histogram" and "format=..." out of the arguments, moving the test
+ * names that remain to the front.  Returns the number of test names.
+ */
+static int parse_options(int ac, char **av)
+{
+	char **wanted = av + 1;
+	int i, nwanted = 0;
+	long val;
+
+	for (i = 1; i < ac; ++i) {
+		if (strcmp(av[i], "histogram") == 0) {
+			print_histogram = true;
+			if (!nr_samples)
+				nr_samples = DEFAULT_SAMPLES;
+		} else if (result_parse_arg(av[i])) {
+			continue;
+		} else if (parse_keyval(av[i], &val) == 7 &&
+			   strncmp(av[i], "samples", 7) == 0) {
+			nr_samples = val > 0 ? val : 0;
+		} else {
+			wanted[nwanted++] = av[i];
+		}
+	}
+	return nwanted;
+}
+
 int main(int ac, char **av)
 {
 	struct fadt_descriptor_rev1 *fadt;
-	int i;
+	int i, nwanted;
 	unsigned long membar = 0;
 	struct pci_dev pcidev;
 	int ret;
 
+	/* first, so that only text output prints free-form lines */
+	nwanted = parse_options(ac, av);
+
 	smp_init();
 	setup_vm();
 	handle_irq(IPI_TEST_VECTOR, self_ipi_isr);
 	nr_cpus = cpu_count();
+	assert_msg(nr_cpus <= MAX_CPUS, "vmexit supports at most %d CPUs",
+		   MAX_CPUS);
 
 	irq_enable();
 	on_cpus(enable_nx, NULL);
+	efer = rdmsr(MSR_EFER);
+
+	if (fwcfg_get_u64(FW_CFG_RAM_SIZE) <= UNBACKED_GPA)
+		unbacked_mmio = ioremap(UNBACKED_GPA, PAGE_SIZE);
+	ioapic_mmio = ioremap(IOAPIC_GPA, PAGE_SIZE);
 
 	fadt = find_acpi_table_addr(FACP_SIGNATURE);
 	pm_tmr_blk = fadt->pm_tmr_blk;
-	printf("PM timer port is %x\n", pm_tmr_blk);
+	if (result_format == RESULT_TEXT)
+		printf("PM timer port is %x\n", pm_tmr_blk);
+	/* Only the per-CPU breakdown converts cycles to time. */
+	if (nr_cpus > 1) {
+		calibrate_tsc();
+		if (result_format == RESULT_TEXT)
+			printf("TSC frequency is %" PRIu64 " kHz\n", tsc_khz);
+		result_config("tsc_khz", "%" PRIu64, tsc_khz);
+	}
 
 	ret = pci_find_dev(PCI_VENDOR_ID_REDHAT, PCI_DEVICE_ID_REDHAT_TEST);
 	if (ret != PCIDEVADDR_INVALID) {
@@ -544,12 +962,25 @@ int main(int ac, char **av)
 		membar = pcidev.resource[PCI_TESTDEV_BAR_MEM];
 		pci_test.memaddr = ioremap(membar, PAGE_SIZE);
 		pci_test.iobar = pcidev.resource[PCI_TESTDEV_BAR_IO];
-		printf("pci-testdev at %#x membar %lx iobar %x\n",
-		       pcidev.bdf, membar, pci_test.iobar);
+		if (result_format == RESULT_TEXT)
+			printf("pci-testdev at %#x membar %lx iobar %x\n",
+			       pcidev.bdf, membar, pci_test.iobar);
+	}
+
+	if (nr_samples) {
+		if (nr_samples > MAX_SAMPLES / nr_cpus)
+			nr_samples = MAX_SAMPLES / nr_cpus;
+		have_rdtscp = has_rdtscp();
+		if (result_format == RESULT_TEXT)
+			printf("sampling %u iterations per CPU, timestamps with %s\n",
+			       nr_samples, have_rdtscp ? "rdtscp" : "lfence; rdtsc");
+		result_config("samples", "%u", nr_samples);
+		result_config("tsc", "%s", have_rdtscp ? "rdtscp" : "lfence");
 	}
+	result_config("cpus", "%d", nr_cpus);
 
 	for (i = 0; i < ARRAY_SIZE(tests); ++i)
-		if (test_wanted(&tests[i], av + 1, ac - 1))
+		if (test_wanted(&tests[i], av + 1, nwanted))
 			while (do_test(&tests[i])) {}
 
 	return 0;